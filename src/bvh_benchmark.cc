@@ -0,0 +1,100 @@
+// Benchmarks of Scene::Intersect() and Scene::Occluded() with each
+// Scene::Accel, for a growing number of boxes.
+#include <benchmark/benchmark.h>
+
+#include <vector>
+
+#include "random.h"
+#include "ray.h"
+
+namespace {
+
+// A room full of randomly placed boxes.
+class BoxScene : public Scene {
+ public:
+  BoxScene(int num_boxes, Accel accel) : Scene(/*max_level=*/0) {
+    Random rng;
+    AddRoom({-10, 0, -10}, {10, 10, 10}, Shader());
+    for (int i = 0; i < num_boxes; ++i) {
+      vec3 p = vec3{rng.rand(), rng.rand(), rng.rand()} * 18. +
+               vec3{-9, 0, -9};
+      vec3 size = vec3{rng.rand(), rng.rand(), rng.rand()} * .5 +
+                  vec3{.05, .05, .05};
+      AddBox(p, p + size, Shader());
+    }
+    Finalize(accel);
+  }
+};
+
+// Rays from random points inside the room in random directions.
+std::vector<Ray> MakeRays(int n) {
+  Random rng;
+  std::vector<Ray> rays;
+  rays.reserve(n);
+  for (int i = 0; i < n; ++i) {
+    vec3 start = vec3{rng.rand(), rng.rand(), rng.rand()} * 18. +
+                 vec3{-9, .5, -9};
+    vec3 dir = vec3{rng.rand(), rng.rand(), rng.rand()} - vec3{.5, .5, .5};
+    rays.push_back(Ray{start, normalize(dir)});
+  }
+  return rays;
+}
+
+void Intersect(benchmark::State& state, Scene::Accel accel) {
+  const BoxScene scene(state.range(0), accel);
+  const std::vector<Ray> rays = MakeRays(4096);
+  size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(scene.Intersect(rays[i]));
+    i = (i + 1) % rays.size();
+  }
+  state.SetItemsProcessed(state.iterations());  // Rays per second.
+}
+
+void BM_IntersectLinear(benchmark::State& state) {
+  Intersect(state, Scene::Accel::kLinear);
+}
+BENCHMARK(BM_IntersectLinear)->RangeMultiplier(4)->Range(16, 4096);
+
+void BM_IntersectSoA(benchmark::State& state) {
+  Intersect(state, Scene::Accel::kSoA);
+}
+BENCHMARK(BM_IntersectSoA)->RangeMultiplier(4)->Range(16, 4096);
+
+void BM_IntersectBVH(benchmark::State& state) {
+  Intersect(state, Scene::Accel::kBVH);
+}
+BENCHMARK(BM_IntersectBVH)->RangeMultiplier(4)->Range(16, 4096);
+
+// Shadow rays: is anything within kShadowDist?
+constexpr double kShadowDist = 3;
+
+void Occluded(benchmark::State& state, Scene::Accel accel) {
+  const BoxScene scene(state.range(0), accel);
+  const std::vector<Ray> rays = MakeRays(4096);
+  size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(scene.Occluded(rays[i], kShadowDist));
+    i = (i + 1) % rays.size();
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+void BM_OccludedLinear(benchmark::State& state) {
+  Occluded(state, Scene::Accel::kLinear);
+}
+BENCHMARK(BM_OccludedLinear)->RangeMultiplier(4)->Range(16, 4096);
+
+void BM_OccludedSoA(benchmark::State& state) {
+  Occluded(state, Scene::Accel::kSoA);
+}
+BENCHMARK(BM_OccludedSoA)->RangeMultiplier(4)->Range(16, 4096);
+
+void BM_OccludedBVH(benchmark::State& state) {
+  Occluded(state, Scene::Accel::kBVH);
+}
+BENCHMARK(BM_OccludedBVH)->RangeMultiplier(4)->Range(16, 4096);
+
+}  // namespace
+
+BENCHMARK_MAIN();
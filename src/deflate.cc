@@ -0,0 +1,643 @@
+// References:
+//   https://www.rfc-editor.org/rfc/rfc1951 (DEFLATE)
+//   zlib's deflate.c and trees.c, for the level settings and lazy matching.
+
+#include "deflate.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <vector>
+
+namespace {
+
+constexpr int kWindowSize = 1 << 15;
+constexpr int kWindowMask = kWindowSize - 1;
+constexpr int kMinMatch = 3;
+constexpr int kMaxMatch = 258;
+// Length 3 matches further away than this cost more than three literals.
+constexpr int kTooFar = 4096;
+
+constexpr int kHashBits = 15;
+constexpr int kHashSize = 1 << kHashBits;
+
+// Symbols per block. Every block gets Huffman codes for its own symbols, so
+// shorter blocks follow changes in the data sooner but send more code tables.
+constexpr int kBlockSymbols = 1 << 14;
+
+constexpr int kNumLitLen = 286;  // 256 literals, end of block, 29 lengths.
+constexpr int kNumDist = 30;
+constexpr int kNumCodeLen = 19;
+constexpr int kMaxSymbols = 288;  // Size of the fixed literal/length code.
+constexpr int kEndOfBlock = 256;
+constexpr int kMaxBits = 15;        // Longest literal/length or distance code.
+constexpr int kMaxCodeLenBits = 7;  // Longest code length code.
+
+// Longest stored block.
+constexpr size_t kMaxStored = 65535;
+
+// How hard each level looks for matches. Follows zlib's table.
+struct Config {
+  int max_chain;  // Hash chain entries to look at per position.
+  int nice_len;   // Stop looking once a match is this long.
+  bool lazy;      // Check the next byte for a longer match before taking one.
+};
+constexpr Config kConfigs[kDeflateMaxLevel + 1] = {
+    {0, 0, false},       {4, 8, false},       {8, 16, false},
+    {32, 32, false},     {16, 16, true},      {32, 32, true},
+    {128, 128, true},    {256, 128, true},    {1024, kMaxMatch, true},
+    {4096, kMaxMatch, true},
+};
+
+constexpr uint16_t kLenBase[29] = {3,  4,  5,  6,   7,   8,   9,   10,  11, 13,
+                                   15, 17, 19, 23,  27,  31,  35,  43,  51, 59,
+                                   67, 83, 99, 115, 131, 163, 195, 227, 258};
+constexpr uint8_t kLenExtra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+                                   1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                   4, 4, 4, 4, 5, 5, 5, 5, 0};
+constexpr uint16_t kDistBase[kNumDist] = {
+    1,    2,    3,    4,    5,    7,     9,     13,    17,  25,
+    33,   49,   65,   97,   129,  193,   257,   385,   513, 769,
+    1025, 1537, 2049, 3073, 4097, 6145,  8193,  12289, 16385, 24577};
+constexpr uint8_t kDistExtra[kNumDist] = {0, 0, 0, 0, 1, 1, 2,  2,  3,  3,
+                                          4, 4, 5, 5, 6, 6, 7,  7,  8,  8,
+                                          9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+// Order in which the code length code's lengths are sent.
+constexpr uint8_t kCodeLenOrder[kNumCodeLen] = {16, 17, 18, 0, 8,  7, 9,
+                                                6,  10, 5,  11, 4, 12, 3,
+                                                13, 2,  14, 1,  15};
+
+// Symbol numbers of match lengths and distances. Distances up to 256 are
+// looked up directly, longer ones by their top bits, like zlib does.
+struct SymbolTables {
+  constexpr SymbolTables() : len(), dist() {
+    for (int code = 0; code < 29; ++code) {
+      for (int n = 0; n < (1 << kLenExtra[code]); ++n) {
+        len[kLenBase[code] + n - kMinMatch] = code;
+      }
+    }
+    for (int code = 0; code < kNumDist; ++code) {
+      for (int n = 0; n < (1 << kDistExtra[code]); ++n) {
+        const int d = kDistBase[code] + n - 1;
+        if (d < 256) {
+          dist[d] = code;
+        } else {
+          dist[256 + (d >> 7)] = code;
+        }
+      }
+    }
+  }
+  uint8_t len[kMaxMatch - kMinMatch + 1];
+  uint8_t dist[512];
+};
+constexpr SymbolTables kSymbols;
+
+int LenSymbol(int len) { return kSymbols.len[len - kMinMatch]; }
+
+int DistSymbol(int dist) {
+  --dist;
+  return (dist < 256) ? kSymbols.dist[dist] : kSymbols.dist[256 + (dist >> 7)];
+}
+
+// Appends bits to a string, least significant bit first.
+class BitWriter {
+ public:
+  explicit BitWriter(std::string* out) : out_(out) {}
+
+  // n must be at most 32.
+  void Put(uint32_t bits, int n) {
+    buf_ |= uint64_t(bits) << count_;
+    count_ += n;
+    if (count_ >= 32) {
+      const char b[4] = {char(buf_), char(buf_ >> 8), char(buf_ >> 16),
+                         char(buf_ >> 24)};
+      out_->append(b, 4);
+      buf_ >>= 32;
+      count_ -= 32;
+    }
+  }
+
+  // Pads with zero bits to the next byte boundary.
+  void Align() {
+    while (count_ > 0) {
+      out_->push_back(char(buf_));
+      buf_ >>= 8;
+      count_ -= 8;
+    }
+    buf_ = 0;
+    count_ = 0;
+  }
+
+  // Aligns, then appends bytes.
+  void Bytes(const uint8_t* data, size_t len) {
+    Align();
+    out_->append(reinterpret_cast<const char*>(data), len);
+  }
+
+ private:
+  std::string* out_;
+  uint64_t buf_ = 0;
+  int count_ = 0;  // Bits in buf_.
+};
+
+// A prefix code: the length of each symbol's code, and the code itself with
+// its bits reversed, ready for BitWriter.
+struct HuffmanCode {
+  uint8_t len[kMaxSymbols];
+  uint16_t bits[kMaxSymbols];
+};
+
+uint16_t ReverseBits(uint16_t code, int len) {
+  uint16_t out = 0;
+  for (int i = 0; i < len; ++i) {
+    out = (out << 1) | (code & 1);
+    code >>= 1;
+  }
+  return out;
+}
+
+// Fills in code->bits from code->len, for the first n symbols. Codes are
+// canonical: shorter codes come first, and codes of the same length are in
+// symbol order.
+void AssignCodes(int n, HuffmanCode* code) {
+  int count[kMaxBits + 1] = {0};
+  for (int i = 0; i < n; ++i) ++count[code->len[i]];
+  count[0] = 0;
+  int next[kMaxBits + 1];
+  int c = 0;
+  for (int len = 1; len <= kMaxBits; ++len) {
+    c = (c + count[len - 1]) << 1;
+    next[len] = c;
+  }
+  for (int i = 0; i < n; ++i) {
+    const int len = code->len[i];
+    code->bits[i] = (len == 0) ? 0 : ReverseBits(next[len]++, len);
+  }
+}
+
+// Sets code->len for the first n symbols to a prefix code for the given
+// frequencies, with no code longer than max_len bits, then assigns the codes.
+//
+// Builds a Huffman tree, then if it's too deep, moves leaves up to max_len and
+// splits shorter ones until the lengths form a complete code again (the
+// method miniz uses). Always codes at least two symbols, since some decoders
+// reject a code with only one.
+void BuildCode(const uint32_t* freq_in, int n, int max_len,
+               HuffmanCode* code) {
+  uint32_t freq[kMaxSymbols];
+  std::copy(freq_in, freq_in + n, freq);
+  int used = 0;
+  for (int i = 0; i < n; ++i) used += (freq[i] > 0);
+  for (int i = 0; used < 2; ++i) {
+    if (freq[i] == 0) {
+      freq[i] = 1;
+      ++used;
+    }
+  }
+
+  // Symbols that occur, by increasing frequency.
+  int syms[kMaxSymbols];
+  int count = 0;
+  for (int i = 0; i < n; ++i) {
+    if (freq[i] > 0) syms[count++] = i;
+  }
+  std::sort(syms, syms + count, [&](int a, int b) {
+    return (freq[a] != freq[b]) ? (freq[a] < freq[b]) : (a < b);
+  });
+
+  // Nodes [0, count) are the leaves in the same order, internal nodes follow
+  // in the order they are made, which is also by increasing weight. So the
+  // two lightest nodes are always at the front of one of the two queues.
+  uint32_t weight[2 * kMaxSymbols];
+  int parent[2 * kMaxSymbols];
+  for (int i = 0; i < count; ++i) weight[i] = freq[syms[i]];
+  int leaf = 0;
+  int node = count;
+  int next = count;
+  auto take = [&]() {
+    if (leaf < count && (node == next || weight[leaf] <= weight[node])) {
+      return leaf++;
+    }
+    return node++;
+  };
+  while (next < 2 * count - 1) {
+    const int a = take();
+    const int b = take();
+    weight[next] = weight[a] + weight[b];
+    parent[a] = next;
+    parent[b] = next;
+    ++next;
+  }
+
+  // Parents come after their children, so walk down from the root.
+  int depth[2 * kMaxSymbols];
+  depth[next - 1] = 0;
+  for (int i = next - 2; i >= 0; --i) depth[i] = depth[parent[i]] + 1;
+
+  int num[kMaxBits + 1] = {0};  // Number of codes of each length.
+  for (int i = 0; i < count; ++i) ++num[std::min(depth[i], max_len)];
+  uint32_t total = 0;  // Kraft sum, in units of 2^-max_len.
+  for (int len = max_len; len > 0; --len) total += num[len] << (max_len - len);
+  while (total != (1u << max_len)) {
+    --num[max_len];
+    for (int len = max_len - 1; len > 0; --len) {
+      if (num[len] > 0) {
+        --num[len];
+        num[len + 1] += 2;
+        break;
+      }
+    }
+    --total;
+  }
+
+  // The least frequent symbols get the longest codes.
+  std::fill(code->len, code->len + n, 0);
+  int i = 0;
+  for (int len = max_len; len > 0; --len) {
+    for (int k = 0; k < num[len]; ++k) code->len[syms[i++]] = len;
+  }
+  AssignCodes(n, code);
+}
+
+HuffmanCode FixedLitLenCode() {
+  HuffmanCode code;
+  for (int i = 0; i < kMaxSymbols; ++i) {
+    code.len[i] = (i < 144) ? 8 : (i < 256) ? 9 : (i < 280) ? 7 : 8;
+  }
+  AssignCodes(kMaxSymbols, &code);
+  return code;
+}
+
+HuffmanCode FixedDistCode() {
+  HuffmanCode code;
+  for (int i = 0; i < 32; ++i) code.len[i] = 5;
+  AssignCodes(32, &code);
+  return code;
+}
+
+const HuffmanCode kFixedLitLen = FixedLitLenCode();
+const HuffmanCode kFixedDist = FixedDistCode();
+
+// Returns how many bytes a and b have in common at the start, up to limit.
+// Compares eight at a time, assuming little endian.
+int MatchLength(const uint8_t* a, const uint8_t* b, int limit) {
+  int n = 0;
+  while (n + 8 <= limit) {
+    uint64_t x, y;
+    memcpy(&x, a + n, 8);
+    memcpy(&y, b + n, 8);
+    if (x != y) return n + __builtin_ctzll(x ^ y) / 8;
+    n += 8;
+  }
+  while (n < limit && a[n] == b[n]) ++n;
+  return n;
+}
+
+// One LZ77 result: a literal byte (dist == 0), or a match of len bytes
+// starting dist bytes back.
+struct Token {
+  uint16_t len_or_literal;
+  uint16_t dist;
+};
+
+class Compressor {
+ public:
+  Compressor(const uint8_t* in, size_t len, int level, std::string* out)
+      : in_(in),
+        len_(len),
+        config_(kConfigs[level]),
+        bits_(out),
+        head_(kHashSize, -1),
+        prev_(kWindowSize) {
+    tokens_.reserve(kBlockSymbols);
+    ResetFreqs();
+  }
+
+  void Run(bool last) {
+    if (config_.lazy) {
+      RunLazy();
+    } else {
+      RunGreedy();
+    }
+    FlushBlock(last);
+    if (!last) {
+      // Sync flush: an empty stored block.
+      bits_.Put(0, 3);
+      const uint8_t empty[4] = {0, 0, 0xff, 0xff};
+      bits_.Bytes(empty, 4);
+    }
+    bits_.Align();
+  }
+
+ private:
+  uint32_t Hash(size_t pos) const {
+    const uint32_t v = (in_[pos] << 16) | (in_[pos + 1] << 8) | in_[pos + 2];
+    return (v * 2654435761u) >> (32 - kHashBits);
+  }
+
+  // Adds pos to its hash chain, if there are enough bytes left to hash.
+  void Insert(size_t pos) {
+    if (pos + kMinMatch > len_) return;
+    const uint32_t h = Hash(pos);
+    prev_[pos & kWindowMask] = head_[h];
+    head_[h] = pos;
+  }
+
+  // Looks for the longest match for pos, which must already be inserted.
+  // Returns its length, or zero if there is none worth sending.
+  int FindMatch(size_t pos, int* dist) const {
+    const int limit = std::min<size_t>(kMaxMatch, len_ - pos);
+    if (limit < kMinMatch) return 0;
+    int best = kMinMatch - 1;
+    int chain = config_.max_chain;
+    for (int32_t cand = prev_[pos & kWindowMask];
+         cand >= 0 && pos - cand < kWindowSize && chain > 0;
+         cand = prev_[cand & kWindowMask], --chain) {
+      // Quick reject: it must beat the best so far.
+      if (in_[cand + best] != in_[pos + best]) continue;
+      const int len = MatchLength(in_ + cand, in_ + pos, limit);
+      if (len > best) {
+        best = len;
+        *dist = pos - cand;
+        if (len >= config_.nice_len || len == limit) break;
+      }
+    }
+    if (best < kMinMatch || (best == kMinMatch && *dist > kTooFar)) return 0;
+    return best;
+  }
+
+  // Takes the longest match at every position.
+  void RunGreedy() {
+    size_t pos = 0;
+    while (pos < len_) {
+      Insert(pos);
+      int dist;
+      const int len = FindMatch(pos, &dist);
+      if (len == 0) {
+        Literal(in_[pos]);
+        ++pos;
+        continue;
+      }
+      Match(len, dist);
+      for (size_t end = pos + len; ++pos < end;) Insert(pos);
+    }
+  }
+
+  // Before taking a match, checks whether the next position has a longer one,
+  // and if so, sends a literal instead.
+  void RunLazy() {
+    // The match found at pos - 1, if have_prev.
+    bool have_prev = false;
+    int prev_len = 0;
+    int prev_dist = 0;
+    size_t pos = 0;
+    while (pos < len_) {
+      Insert(pos);
+      int len = 0;
+      int dist = 0;
+      if (!have_prev || prev_len < config_.nice_len) {
+        len = FindMatch(pos, &dist);
+      }
+      if (have_prev) {
+        if (prev_len > 0 && prev_len >= len) {
+          Match(prev_len, prev_dist);
+          for (size_t end = pos - 1 + prev_len; ++pos < end;) Insert(pos);
+          have_prev = false;
+          continue;
+        }
+        Literal(in_[pos - 1]);
+      }
+      have_prev = true;
+      prev_len = len;
+      prev_dist = dist;
+      ++pos;
+    }
+    // Nothing can match at the last byte.
+    if (have_prev) Literal(in_[pos - 1]);
+  }
+
+  void Literal(uint8_t c) {
+    ++litlen_freq_[c];
+    tokens_.push_back(Token{c, 0});
+    ++covered_;
+    if (tokens_.size() == kBlockSymbols) FlushBlock(/*last=*/false);
+  }
+
+  void Match(int len, int dist) {
+    ++litlen_freq_[257 + LenSymbol(len)];
+    ++dist_freq_[DistSymbol(dist)];
+    tokens_.push_back(Token{uint16_t(len), uint16_t(dist)});
+    covered_ += len;
+    if (tokens_.size() == kBlockSymbols) FlushBlock(/*last=*/false);
+  }
+
+  void ResetFreqs() {
+    std::fill(litlen_freq_, litlen_freq_ + kNumLitLen, 0);
+    std::fill(dist_freq_, dist_freq_ + kNumDist, 0);
+    litlen_freq_[kEndOfBlock] = 1;
+  }
+
+  // Bits needed for the tokens and end of block in the given codes.
+  uint64_t DataBits(const HuffmanCode& litlen, const HuffmanCode& dist) const {
+    uint64_t bits = 0;
+    for (int i = 0; i < kNumLitLen; ++i) {
+      bits += uint64_t(litlen_freq_[i]) * litlen.len[i];
+      if (i > kEndOfBlock) bits += litlen_freq_[i] * kLenExtra[i - 257];
+    }
+    for (int i = 0; i < kNumDist; ++i) {
+      bits += uint64_t(dist_freq_[i]) * (dist.len[i] + kDistExtra[i]);
+    }
+    return bits;
+  }
+
+  // Run-length codes the code lengths of a dynamic block's two codes, as
+  // symbols of the code length alphabet, each followed by its extra bits.
+  struct CodeLens {
+    int hlit, hdist, hclen;
+    std::vector<uint8_t> syms, extra;
+    uint32_t freq[kNumCodeLen] = {0};
+    HuffmanCode code;
+  };
+
+  static void Emit(CodeLens* cl, int sym, int extra) {
+    cl->syms.push_back(sym);
+    cl->extra.push_back(extra);
+    ++cl->freq[sym];
+  }
+
+  static CodeLens EncodeCodeLens(const HuffmanCode& litlen,
+                                 const HuffmanCode& dist) {
+    CodeLens cl;
+    cl.hlit = kNumLitLen;
+    while (cl.hlit > 257 && litlen.len[cl.hlit - 1] == 0) --cl.hlit;
+    cl.hdist = kNumDist;
+    while (cl.hdist > 1 && dist.len[cl.hdist - 1] == 0) --cl.hdist;
+
+    // The lengths form one sequence, runs can cross from one code to the
+    // other.
+    uint8_t lens[kNumLitLen + kNumDist];
+    const int n = cl.hlit + cl.hdist;
+    std::copy(litlen.len, litlen.len + cl.hlit, lens);
+    std::copy(dist.len, dist.len + cl.hdist, lens + cl.hlit);
+    for (int i = 0; i < n;) {
+      const int len = lens[i];
+      int run = 1;
+      while (i + run < n && lens[i + run] == len) ++run;
+      i += run;
+      if (len == 0) {
+        for (; run >= 11; run -= std::min(run, 138)) {
+          Emit(&cl, 18, std::min(run, 138) - 11);
+        }
+        if (run >= 3) {
+          Emit(&cl, 17, run - 3);
+          run = 0;
+        }
+      } else {
+        Emit(&cl, len, 0);
+        --run;
+        for (; run >= 3; run -= std::min(run, 6)) {
+          Emit(&cl, 16, std::min(run, 6) - 3);
+        }
+      }
+      for (; run > 0; --run) Emit(&cl, len, 0);
+    }
+
+    BuildCode(cl.freq, kNumCodeLen, kMaxCodeLenBits, &cl.code);
+    cl.hclen = kNumCodeLen;
+    while (cl.hclen > 4 && cl.code.len[kCodeLenOrder[cl.hclen - 1]] == 0) {
+      --cl.hclen;
+    }
+    return cl;
+  }
+
+  static uint64_t HeaderBits(const CodeLens& cl) {
+    uint64_t bits = 5 + 5 + 4 + 3 * cl.hclen;
+    for (int i = 0; i < cl.syms.size(); ++i) {
+      const int sym = cl.syms[i];
+      bits += cl.code.len[sym];
+      bits += (sym == 16) ? 2 : (sym == 17) ? 3 : (sym == 18) ? 7 : 0;
+    }
+    return bits;
+  }
+
+  void PutHeader(const CodeLens& cl) {
+    bits_.Put(cl.hlit - 257, 5);
+    bits_.Put(cl.hdist - 1, 5);
+    bits_.Put(cl.hclen - 4, 4);
+    for (int i = 0; i < cl.hclen; ++i) {
+      bits_.Put(cl.code.len[kCodeLenOrder[i]], 3);
+    }
+    for (int i = 0; i < cl.syms.size(); ++i) {
+      const int sym = cl.syms[i];
+      bits_.Put(cl.code.bits[sym], cl.code.len[sym]);
+      if (sym == 16) bits_.Put(cl.extra[i], 2);
+      if (sym == 17) bits_.Put(cl.extra[i], 3);
+      if (sym == 18) bits_.Put(cl.extra[i], 7);
+    }
+  }
+
+  void PutTokens(const HuffmanCode& litlen, const HuffmanCode& dist) {
+    for (const Token& t : tokens_) {
+      if (t.dist == 0) {
+        bits_.Put(litlen.bits[t.len_or_literal], litlen.len[t.len_or_literal]);
+        continue;
+      }
+      const int ls = LenSymbol(t.len_or_literal);
+      bits_.Put(litlen.bits[257 + ls], litlen.len[257 + ls]);
+      bits_.Put(t.len_or_literal - kLenBase[ls], kLenExtra[ls]);
+      const int ds = DistSymbol(t.dist);
+      bits_.Put(dist.bits[ds], dist.len[ds]);
+      bits_.Put(t.dist - kDistBase[ds], kDistExtra[ds]);
+    }
+    bits_.Put(litlen.bits[kEndOfBlock], litlen.len[kEndOfBlock]);
+  }
+
+  // Writes the input since the last block as stored blocks.
+  void PutStored(bool last) {
+    size_t pos = block_start_;
+    do {
+      const size_t len = std::min(kMaxStored, covered_ - pos);
+      const bool bfinal = last && pos + len == covered_;
+      bits_.Put(bfinal, 1);
+      bits_.Put(0, 2);  // Stored.
+      bits_.Align();
+      const uint8_t header[4] = {uint8_t(len), uint8_t(len >> 8),
+                                 uint8_t(~len), uint8_t(~len >> 8)};
+      bits_.Bytes(header, 4);
+      bits_.Bytes(in_ + pos, len);
+      pos += len;
+    } while (pos < covered_);
+  }
+
+  // Sends the tokens since the last block in whichever block type is
+  // smallest.
+  void FlushBlock(bool last) {
+    HuffmanCode litlen, dist;
+    BuildCode(litlen_freq_, kNumLitLen, kMaxBits, &litlen);
+    BuildCode(dist_freq_, kNumDist, kMaxBits, &dist);
+    const CodeLens cl = EncodeCodeLens(litlen, dist);
+
+    const uint64_t dynamic_bits = HeaderBits(cl) + DataBits(litlen, dist);
+    const uint64_t fixed_bits = DataBits(kFixedLitLen, kFixedDist);
+    const size_t stored_len = covered_ - block_start_;
+    const uint64_t stored_bits =
+        (stored_len + 5 * (stored_len / kMaxStored + 1)) * 8;
+
+    if (stored_bits <= std::min(dynamic_bits, fixed_bits)) {
+      PutStored(last);
+    } else if (fixed_bits <= dynamic_bits) {
+      bits_.Put(last, 1);
+      bits_.Put(1, 2);  // Fixed Huffman.
+      PutTokens(kFixedLitLen, kFixedDist);
+    } else {
+      bits_.Put(last, 1);
+      bits_.Put(2, 2);  // Dynamic Huffman.
+      PutHeader(cl);
+      PutTokens(litlen, dist);
+    }
+    tokens_.clear();
+    block_start_ = covered_;
+    ResetFreqs();
+  }
+
+  const uint8_t* in_;
+  const size_t len_;
+  const Config config_;
+  BitWriter bits_;
+
+  // Hash chains: the latest position with each hash, and for every position
+  // in the window, the one before it with the same hash. -1 ends a chain.
+  std::vector<int32_t> head_;
+  std::vector<int32_t> prev_;
+
+  // The current block.
+  std::vector<Token> tokens_;
+  uint32_t litlen_freq_[kNumLitLen];
+  uint32_t dist_freq_[kNumDist];
+  size_t block_start_ = 0;  // Input position where it starts.
+  size_t covered_ = 0;      // Input position its tokens reach.
+};
+
+}  // namespace
+
+void Deflate(const uint8_t* in, size_t len, int level, bool last,
+             std::string* out) {
+  assert(level >= 0 && level <= kDeflateMaxLevel);
+  if (level == 0) {
+    // Stored blocks only, which end on byte boundaries anyway. There must be
+    // at least one, even if it's empty.
+    size_t pos = 0;
+    do {
+      const size_t n = std::min(kMaxStored, len - pos);
+      const bool bfinal = last && pos + n == len;
+      const uint8_t header[5] = {uint8_t(bfinal), uint8_t(n), uint8_t(n >> 8),
+                                 uint8_t(~n), uint8_t(~n >> 8)};
+      out->append(reinterpret_cast<const char*>(header), 5);
+      out->append(reinterpret_cast<const char*>(in + pos), n);
+      pos += n;
+    } while (pos < len);
+    return;
+  }
+  Compressor(in, len, level, out).Run(last);
+}
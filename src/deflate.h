@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// DEFLATE compression (RFC 1951), with no dependencies.
+//
+// Finds matches with LZ77 over a 32K window, using hash chains. Each block of
+// the output is stored, or coded with the fixed Huffman code, or with a
+// dynamic Huffman code built for that block, whichever is smallest.
+//
+// Level 0 only stores. Levels 1 to 9 search longer hash chains (from 4 to
+// 4096 candidates per position) and levels 4 and up look one byte ahead for a
+// better match before taking one (lazy matching), like zlib.
+constexpr int kDeflateMaxLevel = 9;
+constexpr int kDeflateDefaultLevel = 6;
+
+// Compresses len bytes from in and appends the deflate stream to out. If
+// last is set, the stream ends with its final block. Otherwise it ends with
+// an empty stored block (a sync flush, as zlib calls it) so that another
+// stream can follow: that's how independently compressed pieces join up.
+// Either way, the output ends on a byte boundary.
+void Deflate(const uint8_t* in, size_t len, int level, bool last,
+             std::string* out);
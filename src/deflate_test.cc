@@ -0,0 +1,22 @@
+// Compresses stdin to a raw deflate stream on stdout.
+// Example usage: ./deflate_test 9 < file | python3 -c "import sys, zlib;
+//   sys.stdout.buffer.write(zlib.decompress(sys.stdin.buffer.read(), -15))" |
+//   cmp - file
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include "deflate.h"
+
+int main(int argc, char** argv) {
+  const int level = (argc > 1) ? atoi(argv[1]) : kDeflateDefaultLevel;
+  std::string in;
+  char buf[1 << 16];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), stdin)) > 0) in.append(buf, n);
+  std::string out;
+  Deflate(reinterpret_cast<const uint8_t*>(in.data()), in.length(), level,
+          /*last=*/true, &out);
+  fwrite(out.data(), 1, out.length(), stdout);
+  fprintf(stderr, "%zu -> %zu bytes\n", in.length(), out.length());
+}
@@ -10,6 +10,7 @@
 #include <err.h>
 
 #include <cmath>
+#include <cstdint>
 #include <cstdio>
 #include <cstring>
 #include <string>
@@ -30,7 +31,7 @@ int ignore_x11_error(Display* d __attribute__((__unused__)),
 
 class GLWindow {
  public:
-  GLWindow(int width, int height, void* data);
+  GLWindow(int width, int height, void* data, DirtyRows* dirty);
   ~GLWindow();
 
   bool IsRunning() const { return running_; }
@@ -58,10 +59,12 @@ class GLWindow {
   static GLuint GetAttribLocationOrDie(GLenum program, const char* name);
   static GLuint MakeArrayBuffer(GLuint attrib_location, int len,
                                 const double* data, int dimensions);
+  void Upload(int y0, int y1);
 
   int width_;
   int height_;
-  void* data_;  // Not owned.
+  void* data_;        // Not owned.
+  DirtyRows* dirty_;  // Not owned, can be null.
 
   Display* dpy_ = nullptr;
   Window win_ = None;
@@ -74,12 +77,18 @@ class GLWindow {
   GLuint buf_uv_;
   GLuint buf_index_;
   GLenum my_program_;
+  GLuint texture_;
+  // Pixel buffer objects to upload through, taking turns, and fences for
+  // when the GPU is done reading them.
+  GLuint pbo_[2];
+  GLsync pbo_fence_[2] = {nullptr, nullptr};
+  int next_pbo_ = 0;
 
   bool running_ = true;
 };
 
-GLWindow::GLWindow(int width, int height, void* data)
-    : width_(width), height_(height), data_(data) {
+GLWindow::GLWindow(int width, int height, void* data, DirtyRows* dirty)
+    : width_(width), height_(height), data_(data), dirty_(dirty) {
   InitX11();
   InitGLX();
   InitGL();
@@ -107,15 +116,57 @@ void GLWindow::EventPoll() {
   }
 }
 
-void GLWindow::Update() {
-  GLint level = 0;
-  GLint border = 0;  // Must be zero according to manpage.
-  GLint internalFormat = GL_RGB;
+// Copies rows [y0, y1) of data_ into the current PBO, and has the GPU copy
+// them from there into the texture. That's a DMA that runs on its own, so
+// nothing here waits for it.
+void GLWindow::Upload(int y0, int y1) {
+  const size_t row_bytes = size_t(width_) * 4;
+  const size_t offset = y0 * row_bytes;
+  const size_t len = (y1 - y0) * row_bytes;
+  // The fence in Update() says the GPU is done with this PBO, so there's
+  // nothing to synchronize with.
+  const GLbitfield access = GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT |
+                           GL_MAP_UNSYNCHRONIZED_BIT;
+  void* dst = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, offset, len, access);
+  CHECK(dst);
+  memcpy(dst, static_cast<const uint8_t*>(data_) + offset, len);
+  CHECK(glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER));
   // nvidia recommends GL_BGRA format in:
   // ftp://download.nvidia.com/developer/Papers/2005/Fast_Texture_Transfers/Fast_Texture_Transfers.pdf
-  GLenum format = GL_BGRA;
-  glTexImage2D(GL_TEXTURE_2D, level, internalFormat, width_, height_, border,
-               format, GL_UNSIGNED_BYTE, data_);
+  glTexSubImage2D(GL_TEXTURE_2D, /* level = */ 0, 0, y0, width_, y1 - y0,
+                  GL_BGRA, GL_UNSIGNED_BYTE,
+                  reinterpret_cast<const void*>(offset));
+}
+
+void GLWindow::Update() {
+  // Wait until the GPU is done with the PBO from two updates ago. It's almost
+  // always done already: there's been a swap since.
+  const int i = next_pbo_;
+  if (pbo_fence_[i] != nullptr) {
+    while (glClientWaitSync(pbo_fence_[i], GL_SYNC_FLUSH_COMMANDS_BIT,
+                            1000000000) == GL_TIMEOUT_EXPIRED) {
+    }
+    glDeleteSync(pbo_fence_[i]);
+    pbo_fence_[i] = nullptr;
+  }
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo_[i]);
+  bool uploaded = false;
+  if (dirty_ == nullptr) {
+    Upload(0, height_);
+    uploaded = true;
+  } else {
+    int y0, y1;
+    for (int y = 0; dirty_->Take(y, &y0, &y1); y = y1) {
+      Upload(y0, y1);
+      uploaded = true;
+    }
+  }
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  if (uploaded) {
+    pbo_fence_[i] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    next_pbo_ = 1 - i;
+  }
+
   glDrawElements(GL_TRIANGLES, 2 * 3, GL_UNSIGNED_INT, 0);
   // glFlush() isn't necessary.
   // Don't glFinish() - it's not needed and it spins on CPU.
@@ -299,19 +350,34 @@ void GLWindow::InitGL() {
   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buf_index_);
   glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(index), index, GL_STATIC_DRAW);
 
-  {
-    GLuint TextureID;
-    glGenTextures(1, &TextureID);
-    glBindTexture(GL_TEXTURE_2D, TextureID);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glGenTextures(1, &texture_);
+  glBindTexture(GL_TEXTURE_2D, texture_);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  // Allocate the texture once, Update() only replaces rows of it.
+  GLint border = 0;  // Must be zero according to manpage.
+  glTexImage2D(GL_TEXTURE_2D, /* level = */ 0, GL_RGB, width_, height_, border,
+               GL_BGRA, GL_UNSIGNED_BYTE, nullptr);
+
+  // STREAM = contents will be modified once and used at most a few times.
+  glGenBuffers(2, pbo_);
+  for (GLuint pbo : pbo_) {
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, size_t(width_) * height_ * 4, nullptr,
+                 GL_STREAM_DRAW);
   }
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
 
   glDisable(GL_DEPTH_TEST);
   glUseProgram(my_program_);
 }
 
 void GLWindow::DoneGL() {
+  for (GLsync fence : pbo_fence_) {
+    if (fence != nullptr) glDeleteSync(fence);
+  }
+  glDeleteBuffers(2, pbo_);
+  glDeleteTextures(1, &texture_);
   glDeleteProgram(my_program_);
   glDeleteBuffers(1, &buf_xyz_);
   glDeleteBuffers(1, &buf_uv_);
@@ -467,10 +533,32 @@ GLWindow* window = nullptr;
 
 }  // namespace
 
+DirtyRows::DirtyRows(int height)
+    : height_(height), rows_(new std::atomic<bool>[height]) {
+  Mark(0, height);
+}
+
+void DirtyRows::Mark(int y0, int y1) {
+  // Release, so that whoever takes the rows sees what was written to them.
+  for (int y = y0; y < y1; ++y) rows_[y].store(true, std::memory_order_release);
+}
+
+bool DirtyRows::Take(int y, int* y0, int* y1) {
+  while (y < height_ && !rows_[y].load(std::memory_order_relaxed)) ++y;
+  if (y == height_) return false;
+  *y0 = y;
+  // A row marked again after this gets taken again next time.
+  while (y < height_ && rows_[y].exchange(false, std::memory_order_acquire)) {
+    ++y;
+  }
+  *y1 = y;
+  return *y0 < *y1;
+}
+
 // static
-void GLViewer::Open(int width, int height, void* data) {
+void GLViewer::Open(int width, int height, void* data, DirtyRows* dirty) {
   CHECK(window == nullptr);
-  window = new GLWindow(width, height, data);
+  window = new GLWindow(width, height, data, dirty);
 }
 
 // static
@@ -1,5 +1,28 @@
 #pragma once
 
+#include <atomic>
+#include <memory>
+
+// Rows of a viewer's data that changed since the viewer last uploaded them.
+// Writers mark rows after writing them, from any thread, and the viewer only
+// uploads those.
+class DirtyRows {
+ public:
+  // Starts out with every row marked.
+  explicit DirtyRows(int height);
+
+  // Marks rows [y0, y1).
+  void Mark(int y0, int y1);
+
+  // Looks for marked rows from y on. If there are any, unmarks the first run
+  // of them, sets [*y0, *y1) to it and returns true.
+  bool Take(int y, int* y0, int* y1);
+
+ private:
+  const int height_;
+  std::unique_ptr<std::atomic<bool>[]> rows_;
+};
+
 // There can only be one window open at a time. All calls
 // must come from the same thread.
 class GLViewer {
@@ -7,8 +30,10 @@ class GLViewer {
   GLViewer() = delete;
 
   // Opens a window. `data` is in 8bpp BGRA format and must outlive the call to
-  // Close().
-  static void Open(int width, int height, void* data);
+  // Close(). If `dirty` is given, it must too, and Update() only uploads the
+  // rows marked there. Otherwise it uploads all of them.
+  static void Open(int width, int height, void* data,
+                   DirtyRows* dirty = nullptr);
 
   // Closes the window.
   static void Close();
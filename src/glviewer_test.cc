@@ -18,22 +18,25 @@ int main() {
   memset(data, 0, sizeof(data));
 
   std::atomic<bool> running = true;
+  DirtyRows dirty(height);
   constexpr int num_threads = 8;
   std::vector<std::thread> threads;
   threads.reserve(num_threads);
   for (int i = 0; i < num_threads; ++i) {
-    threads.emplace_back([&data, &running, i, num_threads]() {
+    threads.emplace_back([&data, &running, &dirty, i, num_threads]() {
+      const int y0 = i * height / num_threads;
+      const int y1 = (i + 1) * height / num_threads;
       int pos = 0;
       int gray = (i + 1) * 255 / num_threads;
       bool on = true;
       while (running) {
-        for (int y = i * height / num_threads;
-             y < (i + 1) * height / num_threads; ++y) {
+        for (int y = y0; y < y1; ++y) {
           int v = on ? gray : 0;
           data[y][pos][0] = v;
           data[y][pos][1] = v;
           data[y][pos][2] = v;
         }
+        dirty.Mark(y0, y1);
         pos++;
         if (pos >= width) {
           pos -= width;
@@ -44,7 +47,7 @@ int main() {
     });
   }
 
-  GLViewer::Open(width, height, data);
+  GLViewer::Open(width, height, data, &dirty);
   while (GLViewer::IsRunning()) {
     GLViewer::Poll();
     GLViewer::Update();
@@ -0,0 +1,65 @@
+// Benchmarks of hemisphere sampling for diffuse bounces.
+#include <benchmark/benchmark.h>
+
+#include "random.h"
+#include "ray.h"
+
+namespace {
+
+// The sampler Shader used to use: random points in a cube, normalized, and
+// rejected until they fall in the hemisphere around n. Not cosine-weighted.
+vec3 RejectionHemisphere(Random& rng, const vec3& n) {
+  vec3 d;
+  do {
+    d = normalize(vec3{rng.rand(), rng.rand(), rng.rand()} - vec3{.5, .5, .5});
+  } while (dot(n, d) <= 0);
+  return d;
+}
+
+// Normals to sample around: not axis-aligned, so neither sampler gets lucky.
+constexpr int kNumNormals = 64;
+struct Normals {
+  Normals() {
+    Random rng;
+    for (auto& n : v) {
+      n = normalize(vec3{rng.rand(), rng.rand(), rng.rand()} -
+                    vec3{.5, .5, .5});
+    }
+  }
+  vec3 v[kNumNormals];
+};
+
+void BM_Rejection(benchmark::State& state) {
+  Random rng;
+  Normals normals;
+  int i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(
+        RejectionHemisphere(rng, normals.v[i++ % kNumNormals]));
+  }
+}
+BENCHMARK(BM_Rejection);
+
+void BM_Cosine(benchmark::State& state) {
+  Random rng;
+  Normals normals;
+  int i = 0;
+  for (auto _ : state) {
+    Onb onb(normals.v[i++ % kNumNormals]);
+    benchmark::DoNotOptimize(onb.ToWorld(vec3::cosine_hemisphere(rng)));
+  }
+}
+BENCHMARK(BM_Cosine);
+
+// Only the local sample, without the basis.
+void BM_CosineLocal(benchmark::State& state) {
+  Random rng;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(vec3::cosine_hemisphere(rng));
+  }
+}
+BENCHMARK(BM_CosineLocal);
+
+}  // namespace
+
+BENCHMARK_MAIN();
@@ -1,8 +1,16 @@
 #pragma once
 
+#include <algorithm>
+#include <cassert>
 #include <cmath>
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <memory>
+#include <utility>
+#include <vector>
+
+#include "tiles.h"
 
 namespace {
 
@@ -13,20 +21,176 @@ constexpr float clip(T f, T min = 0., T max = 1.) {
 
 }  // namespace
 
+// An RGB framebuffer of linear radiance. Pixels go in and come out as
+// doubles a row at a time, whatever the storage.
 class Image {
  public:
-  Image(int width, int height)
+  // How each channel is stored. A 16K x 16K frame takes 6 GB as kF64, 3 GB as
+  // kF32 and 1.5 GB as kF16. Halves top out at 65504 and keep 11 significant
+  // bits, plenty for an 8-bit preview or PNG.
+  enum class Format : uint8_t {
+    kF64,
+    kF32,
+    kF16,
+  };
+
+  // kRows: row after row.
+  // kTiles: square tiles of pixels, each stored row by row in its own run of
+  //   whole cache lines, so threads rendering different tiles never write to
+  //   the same line. The tiles are in Morton order, which is how
+  //   TileScheduler deals them out, so a thread's tiles are close together
+  //   in memory too.
+  enum class Layout : uint8_t {
+    kRows,
+    kTiles,
+  };
+
+  Image(int width, int height, Format format = Format::kF64,
+        Layout layout = Layout::kRows, int tile_size = 0)
       : width_(width),
         height_(height),
-        data_(new double[width_ * height_ * 3]) {}
+        format_(format),
+        layout_(layout),
+        tile_size_(layout == Layout::kTiles ? tile_size : width),
+        pixel_bytes_(3 * (format == Format::kF64   ? 8
+                          : format == Format::kF32 ? 4
+                                                   : 2)) {
+    assert(layout == Layout::kRows || tile_size > 0);
+    size_t bytes;
+    if (layout == Layout::kRows) {
+      bytes = size_t(width) * height * pixel_bytes_;
+    } else {
+      const int tiles_x = (width + tile_size - 1) / tile_size;
+      const int tiles_y = (height + tile_size - 1) / tile_size;
+      tile_bytes_ = RoundUp(size_t(tile_size) * tile_size * pixel_bytes_);
+      std::vector<std::pair<uint64_t, int>> order;
+      for (int ty = 0; ty < tiles_y; ++ty) {
+        for (int tx = 0; tx < tiles_x; ++tx) {
+          order.emplace_back(Morton(tx, ty), ty * tiles_x + tx);
+        }
+      }
+      std::sort(order.begin(), order.end());
+      tile_offset_.resize(order.size());
+      for (size_t i = 0; i < order.size(); ++i) {
+        tile_offset_[order[i].second] = i * tile_bytes_;
+      }
+      bytes = order.size() * tile_bytes_;
+    }
+    size_ = RoundUp(bytes);
+    data_.reset(static_cast<uint8_t*>(aligned_alloc(kCacheLine, size_)));
+  }
 
+  // Gamma encodes one value, slowly. Encoder in tonemap.h does whole rows
+  // with the same results.
   static uint8_t from_float(float linear, float gamma = 2.2) {
     float out = powf(linear, 1. / gamma);
     out = clip(out);
     return static_cast<uint8_t>(out * 255. + .5);
   }
 
+  // The pixels, row after row, if they're stored that way as doubles.
+  double* data() const {
+    assert(format_ == Format::kF64 && layout_ == Layout::kRows);
+    return reinterpret_cast<double*>(data_.get());
+  }
+
+  // Returns pixels [x0, x1) of row y, as RGB doubles. Points into the image
+  // if that's how it's stored, or else converts them into scratch, which
+  // needs room for the pixels.
+  const double* Row(int y, int x0, int x1, double* scratch) const {
+    if (format_ == Format::kF64 && layout_ == Layout::kRows) {
+      return data() + (size_t(y) * width_ + x0) * 3;
+    }
+    ForRuns(y, x0, x1, [this, scratch, x0](int x, int n, size_t offset) {
+      const uint8_t* p = data_.get() + offset;
+      double* dst = scratch + (x - x0) * 3;
+      switch (format_) {
+        case Format::kF64:
+          memcpy(dst, p, n * 24);
+          break;
+        case Format::kF32:
+          std::copy_n(reinterpret_cast<const float*>(p), n * 3, dst);
+          break;
+        case Format::kF16:
+          std::copy_n(reinterpret_cast<const _Float16*>(p), n * 3, dst);
+          break;
+      }
+    });
+    return scratch;
+  }
+
+  // Sets pixels [x0, x1) of row y from RGB doubles.
+  void SetRow(int y, int x0, int x1, const double* src) {
+    ForRuns(y, x0, x1, [this, src, x0](int x, int n, size_t offset) {
+      uint8_t* p = data_.get() + offset;
+      const double* s = src + (x - x0) * 3;
+      switch (format_) {
+        case Format::kF64:
+          memcpy(p, s, n * 24);
+          break;
+        case Format::kF32:
+          std::copy_n(s, n * 3, reinterpret_cast<float*>(p));
+          break;
+        case Format::kF16:
+          std::copy_n(s, n * 3, reinterpret_cast<_Float16*>(p));
+          break;
+      }
+    });
+  }
+
+  // Zeroes slice i of n equal slices of the storage. Whichever thread does
+  // this first touches those pages, see FirstTouch() in sickray.cc.
+  void Zero(int i, int n) {
+    const size_t begin = RoundUp(size_ * i / n);
+    const size_t end = std::min(size_, RoundUp(size_ * (i + 1) / n));
+    if (begin < end) memset(data_.get() + begin, 0, end - begin);
+  }
+
+  // Bytes of storage.
+  size_t size() const { return size_; }
+
   const int width_;
   const int height_;
-  std::unique_ptr<double> data_;
+  const Format format_;
+  const Layout layout_;
+
+ private:
+  static constexpr size_t kCacheLine = 64;
+
+  static size_t RoundUp(size_t bytes) {
+    return (bytes + kCacheLine - 1) / kCacheLine * kCacheLine;
+  }
+
+  // Calls f(x, n, offset) for each run of pixels [x, x + n) of row y, within
+  // [x0, x1), that's contiguous in memory at offset.
+  template <typename F>
+  void ForRuns(int y, int x0, int x1, const F& f) const {
+    if (layout_ == Layout::kRows) {
+      f(x0, x1 - x0, (size_t(y) * width_ + x0) * pixel_bytes_);
+      return;
+    }
+    const int tiles_x = (width_ + tile_size_ - 1) / tile_size_;
+    const int ty = y / tile_size_;
+    const int row = y % tile_size_;
+    for (int x = x0; x < x1;) {
+      const int tx = x / tile_size_;
+      const int col = x % tile_size_;
+      const int n = std::min(x1 - x, tile_size_ - col);
+      f(x, n,
+        tile_offset_[ty * tiles_x + tx] +
+            (size_t(row) * tile_size_ + col) * pixel_bytes_);
+      x += n;
+    }
+  }
+
+  struct Free {
+    void operator()(uint8_t* p) const { free(p); }
+  };
+
+  const int tile_size_;  // Width, for kRows.
+  const int pixel_bytes_;
+  size_t tile_bytes_ = 0;            // Tile to tile, for kTiles.
+  std::vector<size_t> tile_offset_;  // In bytes, by tile row then column.
+  size_t size_;
+  std::unique_ptr<uint8_t[], Free> data_;
 };
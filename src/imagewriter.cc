@@ -0,0 +1,35 @@
+#include "imagewriter.h"
+
+#include <strings.h>
+
+#include <cstring>
+
+#include "writehdr.h"
+#include "writepng.h"
+
+namespace {
+
+bool HasExtension(const char* filename, const char* ext) {
+  const size_t len = strlen(filename);
+  const size_t ext_len = strlen(ext);
+  return len >= ext_len && strcasecmp(filename + len - ext_len, ext) == 0;
+}
+
+}  // namespace
+
+std::unique_ptr<ImageWriter> OpenImageWriter(const char* filename,
+                                             const Image& img, int png_level,
+                                             ToneMap tone) {
+  if (HasExtension(filename, ".pfm")) {
+    return std::make_unique<HdrWriter>(filename, img, HdrWriter::kPfm);
+  }
+  if (HasExtension(filename, ".exr")) {
+    return std::make_unique<HdrWriter>(filename, img, HdrWriter::kExr);
+  }
+  return std::make_unique<PngWriter>(filename, img, png_level, tone);
+}
+
+void WriteImage(const Image& img, const char* filename, int png_level,
+                ToneMap tone, ThreadPool* pool) {
+  OpenImageWriter(filename, img, png_level, tone)->Finish(pool);
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <memory>
+
+#include "tonemap.h"
+
+class Image;
+class ThreadPool;
+
+// Writes an image to a file while it's being rendered: the renderer reports
+// pixels as they become final, and the writer can start converting and
+// writing them out. Done() can be called from many threads at once.
+class ImageWriter {
+ public:
+  virtual ~ImageWriter() = default;
+
+  // Reports that pixels [x0, x1) x [y0, y1) of the image are final.
+  virtual void Done(int x0, int y0, int x1, int y1) = 0;
+
+  // Writes out the pixels Done() hasn't, using the pool if given, and closes
+  // the file. Call once all calls to Done() have returned.
+  virtual void Finish(ThreadPool* pool = nullptr) = 0;
+};
+
+// Opens filename for writing img, in a format picked by its extension: .pfm
+// and .exr are linear float, anything else is PNG with the given compression
+// level and tone mapping. img must outlive the writer.
+std::unique_ptr<ImageWriter> OpenImageWriter(const char* filename,
+                                             const Image& img, int png_level,
+                                             ToneMap tone);
+
+// Writes all of img at once.
+void WriteImage(const Image& img, const char* filename, int png_level,
+                ToneMap tone, ThreadPool* pool = nullptr);
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "random.h"
+#include "ray.h"
+
+// Iterative path tracing. Where Scene::Trace() recurses into every ray a
+// Shader scatters, this follows a single path: shadow rays are tested at each
+// hit, then one of the other bounces is picked at random, in proportion to
+// its weight, and the weight is divided by the probability of picking it.
+// After rr_depth hits, Russian roulette ends paths with probability
+// 1 - throughput (the largest component), and divides the survivors'
+// throughput by the probability of surviving. Paths still end at the scene's
+// max_level().
+//
+// Converges to the same image as Scene::Trace(), but each sample is cheaper
+// and noisier, and deep paths cost little.
+inline vec3 TracePath(const Scene& scene, const Rng& rng_in, Ray r,
+                      int rr_depth) {
+  const Lights& lights = scene.lights();
+  vec3 out{0, 0, 0};
+  vec3 throughput{1, 1, 1};
+  Real pdf = 0;  // See Bounce.
+  Rng rng = rng_in;
+  for (int level = 0; level <= scene.max_level(); ++level) {
+    const Scene::Hit h = scene.Intersect(r);
+    if (h.elem == nullptr) break;
+    const Shader& shader = h.elem->shader;
+    if (shader.light) {
+      out += throughput * shader.color *
+             Shader::LightWeight(lights, h.elem->obj, r, h.dist, pdf);
+      break;
+    }
+    if (level + 1 > scene.max_level()) break;
+
+    Bounce bounces[Shader::kMaxBounces];
+    const int n = shader.Scatter(rng, h.elem->obj, r, h.dist, lights, bounces);
+    Real odds[Shader::kMaxBounces];
+    Real total = 0;
+    for (int i = 0; i < n; ++i) {
+      const Bounce& b = bounces[i];
+      odds[i] = 0;
+      if (b.shadow) {
+        if (!scene.Occluded(b.ray, Shader::kShadowEnd)) {
+          out += throughput * b.weight;
+        }
+        continue;
+      }
+      odds[i] = b.weight.x + b.weight.y + b.weight.z;
+      total += odds[i];
+    }
+    if (total <= 0) break;
+
+    // Pick a bounce to follow.
+    Rng pick = rng.fork(5);
+    Real u = Real(pick.rand()) * total;
+    int chosen = -1;
+    for (int i = 0; i < n; ++i) {
+      if (odds[i] == 0) continue;
+      chosen = i;  // The last candidate, if rounding takes u past the end.
+      if (u < odds[i]) break;
+      u -= odds[i];
+    }
+    const Bounce& b = bounces[chosen];
+    throughput *= b.weight * (total / odds[chosen]);
+
+    if (level + 1 >= rr_depth) {
+      const Real survive =
+          std::min(Real(1), std::max(throughput.x,
+                                     std::max(throughput.y, throughput.z)));
+      if (pick.rand() >= survive) break;
+      throughput /= survive;
+    }
+    r = b.ray;
+    pdf = b.pdf;
+    rng = b.rng;
+  }
+  return out;
+}
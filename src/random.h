@@ -72,3 +72,149 @@ class Random {
 
   uint64_t s[4];
 };
+
+namespace {
+
+// GCC vector extension type of kBytes bytes of T. vector_size can't depend on
+// a template parameter directly.
+template <typename T, int kBytes>
+struct SimdOf;
+template <typename T>
+struct SimdOf<T, 16> {
+  typedef T type __attribute__((vector_size(16)));
+};
+template <typename T>
+struct SimdOf<T, 32> {
+  typedef T type __attribute__((vector_size(32)));
+};
+template <typename T>
+struct SimdOf<T, 64> {
+  typedef T type __attribute__((vector_size(64)));
+};
+
+}  // namespace
+
+// kLanes interleaved xoshiro256+ generators, stepped together. Each state
+// word of all the lanes is one SIMD vector (GCC vector extensions), so every
+// lane steps with the same instructions. Lane l starts as rng.fork(l). For
+// filling arrays with many numbers at once.
+template <int kLanes>
+class RandomLanes {
+ public:
+  using U64s = typename SimdOf<uint64_t, 8 * kLanes>::type;
+  using Doubles = typename SimdOf<double, 8 * kLanes>::type;
+  using Floats = typename SimdOf<float, 4 * kLanes>::type;
+
+  explicit RandomLanes(const Random& rng = Random()) {
+    for (int l = 0; l < kLanes; ++l) {
+      Random r = rng.fork(l);
+      for (int i = 0; i < 4; ++i) s[i][l] = r.s[i];
+    }
+  }
+
+  // Writes n numbers in the range [0, 1) to out, kLanes at a time, in lane
+  // order. Same bits as Random::rand().
+  void Fill(double* out, int n) {
+    for (int i = 0; i < n; i += kLanes) {
+      U64s bits = (next() & 0x000FFFFFFFFFFFFFULL) | 0x3FF0000000000000ULL;
+      Doubles d = (Doubles)bits - 1.;
+      Store(out + i, d, n - i);
+    }
+  }
+
+  // Same for floats. Each 64-bit output makes two floats, from its high and
+  // middle bits: the lowest bits of xoshiro256+ are weaker.
+  void Fill(float* out, int n) {
+    for (int i = 0; i < n; i += 2 * kLanes) {
+      const U64s bits = next();
+      Store(out + i, ToFloats(bits >> 41), n - i);
+      if (n - i > kLanes) {
+        Store(out + i + kLanes, ToFloats(bits >> 18), n - i - kLanes);
+      }
+    }
+  }
+
+  // One xoshiro256+ step of every lane, see Random::next().
+  U64s next() {
+    const U64s result = s[0] + s[3];
+    const U64s t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = (s[3] << 45) | (s[3] >> 19);
+    return result;
+  }
+
+  U64s s[4];
+
+ private:
+  // Floats from the low 23 bits of each lane.
+  static Floats ToFloats(const U64s& bits) {
+    Floats f;
+    for (int l = 0; l < kLanes; ++l) {
+      uint32_t u = (uint32_t(bits[l]) & 0x007FFFFFu) | 0x3F800000u;
+      memcpy(&f[l], &u, 4);
+    }
+    return f - 1.f;
+  }
+
+  // Writes the first min(kLanes, n) lanes of v to out.
+  template <typename V, typename T>
+  static void Store(T* out, const V& v, int n) {
+    if (n >= kLanes) {
+      memcpy(out, &v, sizeof(v));
+    } else {
+      memcpy(out, &v, n * sizeof(T));
+    }
+  }
+};
+
+// Counter-based generator: the nth number drawn is a hash of (key, n), with
+// no other state. The key is a hash of everything forked in, so building a
+// sample's rng from (pixel, sample, bounce) forks costs one hash per fork,
+// and the counter numbers the dimensions drawn from it. The hash is the
+// SplitMix64 finalizer, over a Weyl sequence like SplitMix64 itself. (Squares,
+// from https://arxiv.org/abs/2004.06278, needs five rounds for 64 bits of
+// output, which is slower than xoshiro.) Same interface as Random.
+class CounterRandom {
+ public:
+  CounterRandom() : key(Mix(1)), ctr(0) {}
+
+  // Returns a random number in the range [0, 1)
+  double rand() {
+    uint64_t out = next();
+    out &= 0x000FFFFFFFFFFFFFULL;
+    out |= 0x3FF0000000000000ULL;
+    double d;
+    memcpy(&d, &out, 8);
+    return d - 1.;
+  }
+
+  uint64_t next() { return Mix(key + ++ctr * kGamma); }
+
+  // Returns a new rng with the new mixin added. Unlike Random::fork(), the
+  // result doesn't depend on how many numbers were drawn before. next() does
+  // the thorough mixing, so keys only need one multiply to spread out.
+  CounterRandom fork(uint64_t mixin) const {
+    CounterRandom out;
+    out.key = (key ^ mixin) * 0xdc3eb94af8ab4c93ULL;
+    out.key ^= out.key >> 32;
+    return out;
+  }
+
+  static constexpr uint64_t kGamma = 0x9e3779b97f4a7c15ULL;
+
+  static uint64_t Mix(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+  }
+
+  uint64_t key;
+  uint64_t ctr;
+};
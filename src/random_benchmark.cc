@@ -59,6 +59,91 @@ void BM_Squares(benchmark::State& state) {
 }
 BENCHMARK(BM_Squares);
 
+void BM_CounterNext(benchmark::State& state) {
+  CounterRandom rng;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(rng.next());
+  }
+}
+BENCHMARK(BM_CounterNext);
+
+void BM_CounterRand(benchmark::State& state) {
+  CounterRandom rng;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(rng.rand());
+  }
+}
+BENCHMARK(BM_CounterRand);
+
+void BM_CounterFork(benchmark::State& state) {
+  CounterRandom rng;
+  for (auto _ : state) {
+    rng = rng.fork(1);
+    benchmark::DoNotOptimize(rng);
+  }
+}
+BENCHMARK(BM_CounterFork);
+
+// What the renderer does per sample: fork by line, pixel and sample, then
+// by bounce, and draw a few numbers.
+template <typename R>
+void SampleLoop(benchmark::State& state) {
+  const R rng;
+  uint64_t i = 0;
+  for (auto _ : state) {
+    R sample = rng.fork(i >> 16).fork((i >> 4) & 4095).fork(i & 15);
+    R bounce = sample.fork(1);
+    double sum = 0;
+    for (int d = 0; d < 4; ++d) sum += sample.rand() + bounce.rand();
+    benchmark::DoNotOptimize(sum);
+    ++i;
+  }
+}
+
+void BM_SampleLoop(benchmark::State& state) { SampleLoop<Random>(state); }
+BENCHMARK(BM_SampleLoop);
+
+void BM_CounterSampleLoop(benchmark::State& state) {
+  SampleLoop<CounterRandom>(state);
+}
+BENCHMARK(BM_CounterSampleLoop);
+
+// Batches of this many numbers, about what a wavefront level draws.
+constexpr int kBatch = 1024;
+
+void BM_FillScalar(benchmark::State& state) {
+  Random rng;
+  double out[kBatch];
+  for (auto _ : state) {
+    for (int i = 0; i < kBatch; ++i) out[i] = rng.rand();
+    benchmark::DoNotOptimize(out);
+  }
+  state.SetItemsProcessed(state.iterations() * kBatch);
+}
+BENCHMARK(BM_FillScalar);
+
+template <int kLanes, typename T>
+void FillLanes(benchmark::State& state) {
+  RandomLanes<kLanes> rng;
+  T out[kBatch];
+  for (auto _ : state) {
+    rng.Fill(out, kBatch);
+    benchmark::DoNotOptimize(out);
+  }
+  state.SetItemsProcessed(state.iterations() * kBatch);
+}
+
+void BM_FillLanes4(benchmark::State& state) { FillLanes<4, double>(state); }
+BENCHMARK(BM_FillLanes4);
+
+void BM_FillLanes8(benchmark::State& state) { FillLanes<8, double>(state); }
+BENCHMARK(BM_FillLanes8);
+
+void BM_FillLanes8Float(benchmark::State& state) {
+  FillLanes<8, float>(state);
+}
+BENCHMARK(BM_FillLanes8Float);
+
 }  // namespace
 
 BENCHMARK_MAIN();
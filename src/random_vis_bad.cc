@@ -47,7 +47,7 @@ void ProcessOpts(int argc, char** argv) {
 Image Render() {
   Image out(kWidth, kHeight);
   for (int r = 0; r < runs; ++r) {
-    double* ptr = out.data_.get();
+    double* ptr = out.data();
     timespec t0 = Now();
     for (int y = 0; y < kHeight; ++y) {
       Random rng;
@@ -1,11 +1,30 @@
 #pragma once
 
 #include <cmath>
+#include <algorithm>
 #include <cstdint>
+#include <limits>
 #include <memory>
+#include <type_traits>
 #include <vector>
 
 #include "random.h"
+#include "sampler.h"
+
+// Where rendering gets its random numbers.
+using Rng = Sampler;
+
+// Scalar type for geometry and shading. Build with -DSICKRAY_FLOAT for single
+// precision (the sickray_float target). Pixel sums stay double either way.
+#ifdef SICKRAY_FLOAT
+typedef float Real;
+#else
+typedef double Real;
+#endif
+
+// Distances this small are rounding error, at the scale of our scenes (a few
+// units across).
+constexpr Real kTiny = std::is_same<Real, float>::value ? 1e-4 : 1e-6;
 
 namespace {
 
@@ -21,142 +40,199 @@ constexpr T max(T a, T b) {
 
 template <typename T>
 constexpr T fract(T f) {
-  return f - floor(f);
+  return f - std::floor(f);
 }
 
 }  // namespace
 
-struct vec2 {
+template <typename T>
+struct Vec2T {
  public:
-  vec2 operator*(double d) const { return vec2{x * d, y * d}; }
-  vec2 operator/(double d) const { return vec2{x / d, y / d}; }
-  vec2 operator+(const vec2& v) const { return vec2{x + v.x, y + v.y}; }
-  vec2 operator-(const vec2& v) const { return vec2{x - v.x, y - v.y}; }
-  vec2& operator+=(const vec2& v) {
+  Vec2T operator*(T d) const { return Vec2T{x * d, y * d}; }
+  Vec2T operator/(T d) const { return Vec2T{x / d, y / d}; }
+  Vec2T operator+(const Vec2T& v) const { return Vec2T{x + v.x, y + v.y}; }
+  Vec2T operator-(const Vec2T& v) const { return Vec2T{x - v.x, y - v.y}; }
+  Vec2T& operator+=(const Vec2T& v) {
     *this = *this + v;
     return *this;
   }
-  vec2& operator-=(const vec2& v) {
+  Vec2T& operator-=(const Vec2T& v) {
     *this = *this - v;
     return *this;
   }
-  vec2& operator*=(double d) {
+  Vec2T& operator*=(T d) {
     *this = *this * d;
     return *this;
   }
-  vec2& operator/=(double d) {
+  Vec2T& operator/=(T d) {
     *this = *this / d;
     return *this;
   }
 
-  friend vec2 operator*(double d, const vec2& v) { return v * d; }
+  friend Vec2T operator*(T d, const Vec2T& v) { return v * d; }
 
   // Returns a uniformly distributed random point within the unit circle.
   // Does this by generating points in a square, until one falls inside the
   // circle.
-  static vec2 uniform_disc(Random& rng) {
-    vec2 v;
+  template <typename R>
+  static Vec2T uniform_disc(R& rng) {
+    Vec2T v;
     do {
-      v = 2 * (vec2{rng.rand(), rng.rand()} - vec2{.5, .5});
+      v = 2 * (Vec2T{rng.rand(), rng.rand()} - Vec2T{.5, .5});
     } while ((v.x * v.x + v.y * v.y) > 1.);
     return v;
   }
 
   // Returns a uniformly distributed random point within the unit circle.
   // Does this by generating a random angle and radius.
-  static vec2 uniform_disc2(Random& rng) {
-    double a = 2 * M_PI * rng.rand();
-    double r = sqrt(rng.rand());
-    return r * vec2{cos(a), sin(a)};
+  template <typename R>
+  static Vec2T uniform_disc2(R& rng) {
+    T a = T(2 * M_PI) * T(rng.rand());
+    T r = std::sqrt(rng.rand());
+    return r * Vec2T{std::cos(a), std::sin(a)};
   }
 
   // Returns a uniformly distributed random point within the unit circle.
   // Uses the concentric mapping from:
   // http://www.pbr-book.org/3ed-2018/Monte_Carlo_Integration/2D_Sampling_with_Multidimensional_Transformations.html
-  static vec2 uniform_disc3(Random& rng) {
-    vec2 v = 2 * (vec2{rng.rand(), rng.rand()} - vec2{.5, .5});
-    double a, r;
-    if (fabs(v.x) > fabs(v.y)) {
+  template <typename R>
+  static Vec2T uniform_disc3(R& rng) {
+    Vec2T v = 2 * (Vec2T{rng.rand(), rng.rand()} - Vec2T{.5, .5});
+    T a, r;
+    if (std::fabs(v.x) > std::fabs(v.y)) {
       r = v.x;
-      a = (M_PI / 4) * (v.y / v.x);
+      a = T(M_PI / 4) * (v.y / v.x);
     } else {
       r = v.y;
-      a = (M_PI / 2) - ((M_PI / 4) * (v.x / v.y));
+      a = T(M_PI / 2) - (T(M_PI / 4) * (v.x / v.y));
     }
-    return r * vec2{cos(a), sin(a)};
+    return r * Vec2T{std::cos(a), std::sin(a)};
   }
 
-  double x, y;
+  T x, y;
 };
 
-struct vec3 {
+using vec2 = Vec2T<Real>;
+
+template <typename T>
+struct Vec3T {
  public:
-  vec3 operator+(const vec3& v) const {
-    return vec3{x + v.x, y + v.y, z + v.z};
+  Vec3T operator+(const Vec3T& v) const {
+    return Vec3T{x + v.x, y + v.y, z + v.z};
   }
-  vec3 operator-(const vec3& v) const {
-    return vec3{x - v.x, y - v.y, z - v.z};
+  Vec3T operator-(const Vec3T& v) const {
+    return Vec3T{x - v.x, y - v.y, z - v.z};
   }
 
   // Elementwise.
-  vec3 operator*(const vec3& v) const {
-    return vec3{x * v.x, y * v.y, z * v.z};
+  Vec3T operator*(const Vec3T& v) const {
+    return Vec3T{x * v.x, y * v.y, z * v.z};
   }
 
-  vec3 operator*(double d) const { return vec3{x * d, y * d, z * d}; }
-  vec3 operator/(double d) const { return vec3{x / d, y / d, z / d}; }
+  Vec3T operator*(T d) const { return Vec3T{x * d, y * d, z * d}; }
+  Vec3T operator/(T d) const { return Vec3T{x / d, y / d, z / d}; }
 
   // Unary.
-  vec3 operator-() const { return vec3{-x, -y, -z}; }
+  Vec3T operator-() const { return Vec3T{-x, -y, -z}; }
 
-  vec3& operator+=(const vec3& v) {
+  Vec3T& operator+=(const Vec3T& v) {
     *this = *this + v;
     return *this;
   }
-  vec3& operator-=(const vec3& v) {
+  Vec3T& operator-=(const Vec3T& v) {
     *this = *this - v;
     return *this;
   }
-  vec3& operator*=(const vec3& v) {
+  Vec3T& operator*=(const Vec3T& v) {
     *this = *this * v;
     return *this;
   }
-  vec3& operator*=(double d) {
+  Vec3T& operator*=(T d) {
     *this = *this * d;
     return *this;
   }
-  vec3& operator/=(double d) {
+  Vec3T& operator/=(T d) {
     *this = *this / d;
     return *this;
   }
 
-  friend vec3 operator*(double d, const vec3& v) { return v * d; }
+  friend Vec3T operator*(T d, const Vec3T& v) { return v * d; }
 
-  friend vec3 cross(const vec3& a, const vec3& b) {
-    return vec3{a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z,
+  friend Vec3T cross(const Vec3T& a, const Vec3T& b) {
+    return Vec3T{a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z,
                 a.x * b.y - a.y * b.x};
   }
 
-  friend double dot(const vec3& a, const vec3& b) {
+  friend T dot(const Vec3T& a, const Vec3T& b) {
     return a.x * b.x + a.y * b.y + a.z * b.z;
   }
 
-  friend double length(const vec3& v) { return sqrt(dot(v, v)); }
+  friend T length(const Vec3T& v) { return std::sqrt(dot(v, v)); }
 
-  friend vec3 normalize(const vec3& v) { return v / length(v); }
+  friend Vec3T normalize(const Vec3T& v) { return v / length(v); }
+
+  // Elementwise.
+  friend Vec3T min(const Vec3T& a, const Vec3T& b) {
+    return Vec3T{std::fmin(a.x, b.x), std::fmin(a.y, b.y), std::fmin(a.z, b.z)};
+  }
+  friend Vec3T max(const Vec3T& a, const Vec3T& b) {
+    return Vec3T{std::fmax(a.x, b.x), std::fmax(a.y, b.y), std::fmax(a.z, b.z)};
+  }
 
   // The normal vector must be a unit vector.
-  friend vec3 reflect(const vec3& i, const vec3& n) {
-    vec3 c = n * dot(n, -i);
-    vec3 p = c + i;
+  friend Vec3T reflect(const Vec3T& i, const Vec3T& n) {
+    Vec3T c = n * dot(n, -i);
+    Vec3T p = c + i;
     return c + p;
   }
 
-  vec2 xy() const { return vec2{x, y}; }
-  vec2 xz() const { return vec2{x, z}; }
-  vec2 yz() const { return vec2{y, z}; }
+  // Component by axis number: 0 = x, 1 = y, 2 = z.
+  T operator[](int axis) const {
+    return (axis == 0) ? x : ((axis == 1) ? y : z);
+  }
+
+  // Widening conversion, e.g. from a float vec3 to a vec3d.
+  template <typename U, typename = std::enable_if_t<(sizeof(U) > sizeof(T))>>
+  operator Vec3T<U>() const {
+    return Vec3T<U>{x, y, z};
+  }
+
+  Vec2T<T> xy() const { return Vec2T<T>{x, y}; }
+  Vec2T<T> xz() const { return Vec2T<T>{x, z}; }
+  Vec2T<T> yz() const { return Vec2T<T>{y, z}; }
+
+  // Returns a random unit vector in the +z hemisphere, with probability
+  // density proportional to the cosine of its angle to +z. Does this by
+  // projecting a uniform point on the unit disc up onto the hemisphere.
+  template <typename R>
+  static Vec3T cosine_hemisphere(R& rng) {
+    Vec2T<T> v = Vec2T<T>::uniform_disc3(rng);
+    return Vec3T{v.x, v.y,
+                 std::sqrt(std::fmax(T(0), 1 - v.x * v.x - v.y * v.y))};
+  }
+
+  T x, y, z;
+};
+
+using vec3 = Vec3T<Real>;
+using vec3d = Vec3T<double>;  // For sums of many samples.
+
+// Orthonormal basis around a unit vector w, without branches on its
+// direction. From "Building an Orthonormal Basis, Revisited" (Duff et al.
+// 2017).
+struct Onb {
+  explicit Onb(const vec3& n) : w(n) {
+    Real sign = std::copysign(Real(1), n.z);
+    Real a = -1 / (sign + n.z);
+    Real b = n.x * n.y * a;
+    u = vec3{1 + sign * n.x * n.x * a, sign * b, -sign * n.x};
+    v = vec3{b, sign + n.y * n.y * a, -n.y};
+  }
+
+  // Maps a vector in local coordinates, where w is +z, to world coordinates.
+  vec3 ToWorld(const vec3& l) const { return u * l.x + v * l.y + w * l.z; }
 
-  double x, y, z;
+  vec3 u, v, w;
 };
 
 struct Lookat {
@@ -173,63 +249,164 @@ struct Lookat {
 
 struct Ray {
  public:
-  vec3 p(double dist) const { return start + dir * dist; }
+  vec3 p(Real dist) const { return start + dir * dist; }
 
   vec3 start, dir;
 };
 
+// Up to kSize rays in structure-of-arrays form, so that loops over the lanes
+// compile to SIMD instructions.
+struct RayPacket {
+ public:
+  static constexpr int kSize = 8;
+
+  // Lanes past n get a copy of ray 0, so they do valid (but unused) math.
+  RayPacket(const Ray* rays, int n) : n(n) {
+    for (int l = 0; l < kSize; ++l) {
+      const Ray& r = rays[(l < n) ? l : 0];
+      for (int axis = 0; axis < 3; ++axis) {
+        start[axis][l] = r.start[axis];
+        dir[axis][l] = r.dir[axis];
+        inv_dir[axis][l] = 1 / r.dir[axis];
+      }
+    }
+  }
+
+  Ray ray(int l) const {
+    return Ray{{start[0][l], start[1][l], start[2][l]},
+               {dir[0][l], dir[1][l], dir[2][l]}};
+  }
+
+  int n;  // Active lanes.
+  Real start[3][kSize];
+  Real dir[3][kSize];
+  Real inv_dir[3][kSize];
+};
+
+// Axis-aligned bounding box.
+struct AABB {
+ public:
+  // Contains nothing, extending it by anything gives that thing.
+  static AABB Empty() {
+    constexpr Real inf = std::numeric_limits<Real>::infinity();
+    return AABB{{inf, inf, inf}, {-inf, -inf, -inf}};
+  }
+
+  // Contains everything. Used for objects that have no bounds.
+  static AABB Infinite() {
+    constexpr Real inf = std::numeric_limits<Real>::infinity();
+    return AABB{{-inf, -inf, -inf}, {inf, inf, inf}};
+  }
+
+  void Extend(const AABB& b) {
+    lo = min(lo, b.lo);
+    hi = max(hi, b.hi);
+  }
+
+  void Extend(const vec3& p) {
+    lo = min(lo, p);
+    hi = max(hi, p);
+  }
+
+  bool IsFinite() const {
+    return std::isfinite(lo.x) && std::isfinite(lo.y) && std::isfinite(lo.z) &&
+           std::isfinite(hi.x) && std::isfinite(hi.y) && std::isfinite(hi.z);
+  }
+
+  vec3 Center() const { return (lo + hi) * .5; }
+
+  // Surface area, for the SAH.
+  Real Area() const {
+    vec3 d = hi - lo;
+    if (d.x < 0 || d.y < 0 || d.z < 0) return 0;
+    return 2 * (d.x * d.y + d.y * d.z + d.z * d.x);
+  }
+
+  // Slab test. Returns the distance along the ray where it enters the box, or
+  // a negative number if it misses the box or only hits it beyond max_dist.
+  // inv_dir is 1/r.dir, precomputed by the caller.
+  Real Enter(const Ray& r, const vec3& inv_dir, Real max_dist) const {
+    vec3 t0 = (lo - r.start) * inv_dir;
+    vec3 t1 = (hi - r.start) * inv_dir;
+    vec3 tmin = min(t0, t1);
+    vec3 tmax = max(t0, t1);
+    Real enter = std::fmax(std::fmax(tmin.x, tmin.y), std::fmax(tmin.z, 0.));
+    Real leave =
+        std::fmin(std::fmin(tmax.x, tmax.y), std::fmin(tmax.z, max_dist));
+    return (enter <= leave) ? enter : -1;
+  }
+
+  vec3 lo, hi;
+};
+
 class Object {
  public:
   virtual ~Object() {}
 
   // Returns distance along the ray, or a negative number if there is no
   // intersection.
-  virtual double Intersect(const Ray& r) const = 0;
+  virtual Real Intersect(const Ray& r) const = 0;
 
   // Returns the normal vector at intersection point p. Must be a unit vector.
   virtual vec3 Normal(const vec3& p) const = 0;
+
+  // Returns a box enclosing the object. Objects that don't override this are
+  // unbounded and get tested against every ray.
+  virtual AABB Bounds() const { return AABB::Infinite(); }
+
+  // Surface area, for sampling points on lights. Objects that don't override
+  // this can't be sampled.
+  virtual Real Area() const { return 0; }
+
+  // Maps uv in [0, 1)^2 to a point on the surface, uniformly by area.
+  virtual vec3 SamplePoint(const vec2& uv) const { return vec3{0, 0, 0}; }
 };
 
 class Sphere : public Object {
  public:
-  Sphere(vec3 center, double radius) : center(center), radius(radius) {}
+  Sphere(vec3 center, Real radius) : center(center), radius(radius) {}
 
-  double Intersect(const Ray& r) const override {
+  Real Intersect(const Ray& r) const override {
     vec3 ec = r.start - center;
-    double a = dot(r.dir, r.dir);
-    double b = 2. * dot(r.dir, ec);
-    double c = dot(ec, ec) - sqr(radius);
-    double det = b * b - 4. * a * c;
+    Real a = dot(r.dir, r.dir);
+    Real b = 2 * dot(r.dir, ec);
+    Real c = dot(ec, ec) - sqr(radius);
+    Real det = b * b - 4 * a * c;
     if (det < 0) return -1;
-    return (-b - sqrt(det)) / (2. * a);
+    return (-b - std::sqrt(det)) / (2 * a);
   }
 
   vec3 Normal(const vec3& p) const override { return normalize(p - center); }
 
+  AABB Bounds() const override {
+    vec3 r{radius, radius, radius};
+    return AABB{center - r, center + r};
+  }
+
   vec3 center;
-  double radius;
+  Real radius;
 };
 
 class Ground : public Object {
  public:
-  explicit Ground(double height) : height(height) {}
+  explicit Ground(Real height) : height(height) {}
 
-  double Intersect(const Ray& r) const override {
+  Real Intersect(const Ray& r) const override {
     return (height - r.start.y) / r.dir.y;
   }
 
   vec3 Normal(const vec3& p) const override { return vec3{0, 1, 0}; }
 
-  double height;
+  Real height;
 };
 
 class LeftPlane : public Object {
  public:
-  LeftPlane(double x, const vec2& yz1, const vec2& yz2)
+  LeftPlane(Real x, const vec2& yz1, const vec2& yz2)
       : x(x), yz1(yz1), yz2(yz2) {}
 
-  double Intersect(const Ray& r) const override {
-    double dist = (x - r.start.x) / r.dir.x;
+  Real Intersect(const Ray& r) const override {
+    Real dist = (x - r.start.x) / r.dir.x;
     vec3 p = r.p(dist);
     // Is it outside the rectangle?
     if (p.y < yz1.x || p.z < yz1.y || p.y > yz2.x || p.z > yz2.y) return -1;
@@ -238,17 +415,28 @@ class LeftPlane : public Object {
 
   vec3 Normal(const vec3& p) const override { return vec3{1, 0, 0}; }
 
-  double x;
+  AABB Bounds() const override {
+    return AABB{vec3{x, yz1.x, yz1.y}, vec3{x, yz2.x, yz2.y}};
+  }
+
+  Real Area() const override { return (yz2.x - yz1.x) * (yz2.y - yz1.y); }
+
+  vec3 SamplePoint(const vec2& uv) const override {
+    return vec3{x, yz1.x + uv.x * (yz2.x - yz1.x),
+                yz1.y + uv.y * (yz2.y - yz1.y)};
+  }
+
+  Real x;
   vec2 yz1, yz2;
 };
 
 class RightPlane : public Object {
  public:
-  RightPlane(double x, const vec2& yz1, const vec2& yz2)
+  RightPlane(Real x, const vec2& yz1, const vec2& yz2)
       : x(x), yz1(yz1), yz2(yz2) {}
 
-  double Intersect(const Ray& r) const override {
-    double dist = (x - r.start.x) / r.dir.x;
+  Real Intersect(const Ray& r) const override {
+    Real dist = (x - r.start.x) / r.dir.x;
     vec3 p = r.p(dist);
     // Is it outside the rectangle?
     if (p.y < yz1.x || p.z < yz1.y || p.y > yz2.x || p.z > yz2.y) return -1;
@@ -257,17 +445,28 @@ class RightPlane : public Object {
 
   vec3 Normal(const vec3& p) const override { return vec3{-1, 0, 0}; }
 
-  double x;
+  AABB Bounds() const override {
+    return AABB{vec3{x, yz1.x, yz1.y}, vec3{x, yz2.x, yz2.y}};
+  }
+
+  Real Area() const override { return (yz2.x - yz1.x) * (yz2.y - yz1.y); }
+
+  vec3 SamplePoint(const vec2& uv) const override {
+    return vec3{x, yz1.x + uv.x * (yz2.x - yz1.x),
+                yz1.y + uv.y * (yz2.y - yz1.y)};
+  }
+
+  Real x;
   vec2 yz1, yz2;
 };
 
 class FwdPlane : public Object {
  public:
-  FwdPlane(double z, const vec2& xy1, const vec2& xy2)
+  FwdPlane(Real z, const vec2& xy1, const vec2& xy2)
       : z(z), xy1(xy1), xy2(xy2) {}
 
-  double Intersect(const Ray& r) const override {
-    double dist = (z - r.start.z) / r.dir.z;
+  Real Intersect(const Ray& r) const override {
+    Real dist = (z - r.start.z) / r.dir.z;
     vec3 p = r.p(dist);
     // Is it outside the rectangle?
     if (p.x < xy1.x || p.y < xy1.y || p.x > xy2.x || p.y > xy2.y) return -1;
@@ -276,17 +475,28 @@ class FwdPlane : public Object {
 
   vec3 Normal(const vec3& p) const override { return vec3{0, 0, 1}; }
 
-  double z;
+  AABB Bounds() const override {
+    return AABB{vec3{xy1.x, xy1.y, z}, vec3{xy2.x, xy2.y, z}};
+  }
+
+  Real Area() const override { return (xy2.x - xy1.x) * (xy2.y - xy1.y); }
+
+  vec3 SamplePoint(const vec2& uv) const override {
+    return vec3{xy1.x + uv.x * (xy2.x - xy1.x), xy1.y + uv.y * (xy2.y - xy1.y),
+                z};
+  }
+
+  Real z;
   vec2 xy1, xy2;
 };
 
 class BackPlane : public Object {
  public:
-  BackPlane(double z, const vec2& xy1, const vec2& xy2)
+  BackPlane(Real z, const vec2& xy1, const vec2& xy2)
       : z(z), xy1(xy1), xy2(xy2) {}
 
-  double Intersect(const Ray& r) const override {
-    double dist = (z - r.start.z) / r.dir.z;
+  Real Intersect(const Ray& r) const override {
+    Real dist = (z - r.start.z) / r.dir.z;
     vec3 p = r.p(dist);
     // Is it outside the rectangle?
     if (p.x < xy1.x || p.y < xy1.y || p.x > xy2.x || p.y > xy2.y) return -1;
@@ -295,17 +505,28 @@ class BackPlane : public Object {
 
   vec3 Normal(const vec3& p) const override { return vec3{0, 0, -1}; }
 
-  double z;
+  AABB Bounds() const override {
+    return AABB{vec3{xy1.x, xy1.y, z}, vec3{xy2.x, xy2.y, z}};
+  }
+
+  Real Area() const override { return (xy2.x - xy1.x) * (xy2.y - xy1.y); }
+
+  vec3 SamplePoint(const vec2& uv) const override {
+    return vec3{xy1.x + uv.x * (xy2.x - xy1.x), xy1.y + uv.y * (xy2.y - xy1.y),
+                z};
+  }
+
+  Real z;
   vec2 xy1, xy2;
 };
 
 class TopPlane : public Object {
  public:
-  TopPlane(double y, const vec2& xz1, const vec2& xz2)
+  TopPlane(Real y, const vec2& xz1, const vec2& xz2)
       : y(y), xz1(xz1), xz2(xz2) {}
 
-  double Intersect(const Ray& r) const override {
-    double dist = (y - r.start.y) / r.dir.y;
+  Real Intersect(const Ray& r) const override {
+    Real dist = (y - r.start.y) / r.dir.y;
     vec3 p = r.p(dist);
     // Is it outside the rectangle?
     if (p.x < xz1.x || p.z < xz1.y || p.x > xz2.x || p.z > xz2.y) return -1;
@@ -314,17 +535,28 @@ class TopPlane : public Object {
 
   vec3 Normal(const vec3& p) const override { return vec3{0, -1, 0}; }
 
-  double y;
+  AABB Bounds() const override {
+    return AABB{vec3{xz1.x, y, xz1.y}, vec3{xz2.x, y, xz2.y}};
+  }
+
+  Real Area() const override { return (xz2.x - xz1.x) * (xz2.y - xz1.y); }
+
+  vec3 SamplePoint(const vec2& uv) const override {
+    return vec3{xz1.x + uv.x * (xz2.x - xz1.x), y,
+                xz1.y + uv.y * (xz2.y - xz1.y)};
+  }
+
+  Real y;
   vec2 xz1, xz2;
 };
 
 class BtmPlane : public Object {
  public:
-  BtmPlane(double y, const vec2& xz1, const vec2& xz2)
+  BtmPlane(Real y, const vec2& xz1, const vec2& xz2)
       : y(y), xz1(xz1), xz2(xz2) {}
 
-  double Intersect(const Ray& r) const override {
-    double dist = (y - r.start.y) / r.dir.y;
+  Real Intersect(const Ray& r) const override {
+    Real dist = (y - r.start.y) / r.dir.y;
     vec3 p = r.p(dist);
     // Is it outside the rectangle?
     if (p.x < xz1.x || p.z < xz1.y || p.x > xz2.x || p.z > xz2.y) return -1;
@@ -333,67 +565,820 @@ class BtmPlane : public Object {
 
   vec3 Normal(const vec3& p) const override { return vec3{0, 1, 0}; }
 
-  double y;
+  AABB Bounds() const override {
+    return AABB{vec3{xz1.x, y, xz1.y}, vec3{xz2.x, y, xz2.y}};
+  }
+
+  Real Area() const override { return (xz2.x - xz1.x) * (xz2.y - xz1.y); }
+
+  vec3 SamplePoint(const vec2& uv) const override {
+    return vec3{xz1.x + uv.x * (xz2.x - xz1.x), y,
+                xz1.y + uv.y * (xz2.y - xz1.y)};
+  }
+
+  Real y;
   vec2 xz1, xz2;
 };
 
+// Axis-aligned box, intersected with the slab test. Normals point outwards,
+// or inwards if inverted (for rooms).
+class Box : public Object {
+ public:
+  Box(const vec3& lo, const vec3& hi, bool inverted = false)
+      : lo(lo), hi(hi), inverted(inverted) {}
+
+  Real Intersect(const Ray& r) const override {
+    const vec3 inv_dir{1 / r.dir.x, 1 / r.dir.y, 1 / r.dir.z};
+    vec3 t0 = (lo - r.start) * inv_dir;
+    vec3 t1 = (hi - r.start) * inv_dir;
+    vec3 tmin = min(t0, t1);
+    vec3 tmax = max(t0, t1);
+    Real enter = std::fmax(std::fmax(tmin.x, tmin.y), tmin.z);
+    Real leave = std::fmin(std::fmin(tmax.x, tmax.y), tmax.z);
+    if (enter > leave) return -1;
+    // From inside the box, the hit is where the ray leaves.
+    return (enter > 0) ? enter : leave;
+  }
+
+  vec3 Normal(const vec3& p) const override {
+    // The face that p is closest to.
+    Real best = std::fabs(p.x - lo.x);
+    vec3 n{-1, 0, 0};
+    auto check = [&p, &best, &n](Real face, Real pos, const vec3& normal) {
+      Real d = std::fabs(pos - face);
+      if (d < best) {
+        best = d;
+        n = normal;
+      }
+    };
+    check(hi.x, p.x, {1, 0, 0});
+    check(lo.y, p.y, {0, -1, 0});
+    check(hi.y, p.y, {0, 1, 0});
+    check(lo.z, p.z, {0, 0, -1});
+    check(hi.z, p.z, {0, 0, 1});
+    return inverted ? -n : n;
+  }
+
+  AABB Bounds() const override { return AABB{lo, hi}; }
+
+  vec3 lo, hi;
+  bool inverted;
+};
+
+// Bounding volume hierarchy, built with the binned surface area heuristic.
+// It only knows about boxes: leaves refer to primitives by their index in the
+// array that was passed to Build().
+class BVH {
+ public:
+  void Build(const std::vector<AABB>& boxes) {
+    nodes_.clear();
+    index_.resize(boxes.size());
+    for (size_t i = 0; i < boxes.size(); ++i) index_[i] = i;
+    if (boxes.empty()) return;
+    std::vector<vec3> centers;
+    centers.reserve(boxes.size());
+    for (const auto& b : boxes) centers.push_back(b.Center());
+    nodes_.reserve(2 * boxes.size());
+    nodes_.emplace_back();
+    Subdivide(0, 0, boxes.size(), /*depth=*/0, boxes, centers);
+  }
+
+  bool empty() const { return nodes_.empty(); }
+
+  // Calls leaf(index, max_dist) for every primitive whose box the ray enters
+  // no further than max_dist. leaf() returns the new max_dist, which prunes
+  // the rest of the traversal. Nearer children are visited first.
+  template <typename F>
+  void Traverse(const Ray& r, Real max_dist, F leaf) const {
+    if (nodes_.empty()) return;
+    const vec3 inv_dir{1 / r.dir.x, 1 / r.dir.y, 1 / r.dir.z};
+    if (nodes_[0].box.Enter(r, inv_dir, max_dist) < 0) return;
+    struct Pending {
+      int node;
+      Real enter;
+    };
+    Pending stack[kMaxDepth];
+    int sp = 0;
+    int n = 0;
+    while (1) {
+      const Node& node = nodes_[n];
+      if (node.count > 0) {
+        for (int i = node.first; i < node.first + node.count; ++i) {
+          max_dist = leaf(index_[i], max_dist);
+        }
+      } else {
+        int a = node.first;
+        int b = a + 1;
+        Real da = nodes_[a].box.Enter(r, inv_dir, max_dist);
+        Real db = nodes_[b].box.Enter(r, inv_dir, max_dist);
+        if (da >= 0 && db >= 0) {
+          if (db < da) {
+            std::swap(a, b);
+            std::swap(da, db);
+          }
+          stack[sp++] = Pending{b, db};
+          n = a;
+          continue;
+        }
+        if (da >= 0) {
+          n = a;
+          continue;
+        }
+        if (db >= 0) {
+          n = b;
+          continue;
+        }
+      }
+      // Pop the next node that's still in range.
+      do {
+        if (sp == 0) return;
+        --sp;
+      } while (stack[sp].enter > max_dist);
+      n = stack[sp].node;
+    }
+  }
+
+  // Calls hit(index) for primitives whose box the ray enters no further than
+  // max_dist, until one returns true. Returns whether one did. Any hit will
+  // do, so children are visited in no particular order.
+  template <typename F>
+  bool Any(const Ray& r, Real max_dist, F hit) const {
+    if (nodes_.empty()) return false;
+    const vec3 inv_dir{1 / r.dir.x, 1 / r.dir.y, 1 / r.dir.z};
+    int stack[kMaxDepth];
+    int sp = 0;
+    int n = 0;
+    while (1) {
+      const Node& node = nodes_[n];
+      if (node.box.Enter(r, inv_dir, max_dist) >= 0) {
+        if (node.count == 0) {
+          stack[sp++] = node.first + 1;
+          n = node.first;
+          continue;
+        }
+        for (int i = node.first; i < node.first + node.count; ++i) {
+          if (hit(index_[i])) return true;
+        }
+      }
+      if (sp == 0) return false;
+      n = stack[--sp];
+    }
+  }
+
+  // Packet version of Traverse(). Calls leaf(index) for every primitive whose
+  // box is entered by at least one lane no further than that lane's
+  // max_dist[]. leaf() is expected to lower max_dist[] for the lanes it hits.
+  // Lanes with a negative max_dist are ignored.
+  template <typename F>
+  void TraversePacket(const RayPacket& p, const Real* max_dist,
+                      F leaf) const {
+    if (nodes_.empty()) return;
+    int stack[2 * kMaxDepth];
+    int sp = 0;
+    stack[sp++] = 0;
+    while (sp > 0) {
+      const Node& node = nodes_[stack[--sp]];
+      if (!AnyEnter(node.box, p, max_dist)) continue;
+      if (node.count > 0) {
+        for (int i = node.first; i < node.first + node.count; ++i) {
+          leaf(index_[i]);
+        }
+        continue;
+      }
+      // Visit the child nearer to the packet first, judging by the axis the
+      // children are most separated on and the direction of the first ray.
+      int a = node.first;
+      int b = a + 1;
+      vec3 d = nodes_[b].box.Center() - nodes_[a].box.Center();
+      int axis = (std::fabs(d.x) > std::fabs(d.y)) ? 0 : 1;
+      if (std::fabs(d.z) > std::fabs(d[axis])) axis = 2;
+      if (d[axis] * p.dir[axis][0] < 0) std::swap(a, b);
+      stack[sp++] = b;
+      stack[sp++] = a;
+    }
+  }
+
+ private:
+  static constexpr int kBins = 16;
+  static constexpr int kMaxLeafSize = 4;
+  // Deeper than this and the node becomes a leaf regardless of size. Also
+  // bounds the traversal stack.
+  static constexpr int kMaxDepth = 64;
+  // Cost of visiting a node, relative to intersecting one primitive.
+  static constexpr Real kTraversalCost = 1.;
+
+  struct Node {
+    AABB box;
+    int first;  // Leaf: into index_. Interior: left child, right is first + 1.
+    int count;  // Zero for interior nodes.
+  };
+
+  // Slab test for the whole packet. Returns true if any lane hits.
+  static bool AnyEnter(const AABB& box, const RayPacket& p,
+                       const Real* max_dist) {
+    bool any = false;
+    for (int l = 0; l < RayPacket::kSize; ++l) {
+      Real enter = 0;
+      Real leave = max_dist[l];
+      for (int axis = 0; axis < 3; ++axis) {
+        Real t0 = (box.lo[axis] - p.start[axis][l]) * p.inv_dir[axis][l];
+        Real t1 = (box.hi[axis] - p.start[axis][l]) * p.inv_dir[axis][l];
+        enter = std::fmax(enter, std::fmin(t0, t1));
+        leave = std::fmin(leave, std::fmax(t0, t1));
+      }
+      any |= enter <= leave;
+    }
+    return any;
+  }
+
+  void Subdivide(int n, int begin, int end, int depth,
+                 const std::vector<AABB>& boxes,
+                 const std::vector<vec3>& centers) {
+    AABB box = AABB::Empty();
+    AABB cbox = AABB::Empty();
+    for (int i = begin; i < end; ++i) {
+      box.Extend(boxes[index_[i]]);
+      cbox.Extend(centers[index_[i]]);
+    }
+    const int count = end - begin;
+    nodes_[n].box = box;
+    nodes_[n].first = begin;
+    nodes_[n].count = count;
+    if (count <= 1 || depth >= kMaxDepth - 1) return;
+
+    // Find the cheapest split among the bin boundaries on all three axes.
+    struct Bin {
+      AABB box = AABB::Empty();
+      int count = 0;
+    };
+    Real best_cost = std::numeric_limits<Real>::infinity();
+    int best_axis = -1;
+    int best_split = 0;
+    for (int axis = 0; axis < 3; ++axis) {
+      const Real lo = cbox.lo[axis];
+      const Real hi = cbox.hi[axis];
+      if (!(hi > lo)) continue;
+      const Real scale = kBins / (hi - lo);
+      Bin bins[kBins];
+      for (int i = begin; i < end; ++i) {
+        const Real c = centers[index_[i]][axis];
+        const int b = std::min(kBins - 1, int((c - lo) * scale));
+        bins[b].count++;
+        bins[b].box.Extend(boxes[index_[i]]);
+      }
+      // Sweep from the right to get the cost of everything above each split.
+      Real right_cost[kBins];
+      AABB acc = AABB::Empty();
+      int acc_count = 0;
+      for (int b = kBins - 1; b > 0; --b) {
+        acc.Extend(bins[b].box);
+        acc_count += bins[b].count;
+        right_cost[b] = acc_count * acc.Area();
+      }
+      acc = AABB::Empty();
+      acc_count = 0;
+      for (int split = 1; split < kBins; ++split) {
+        acc.Extend(bins[split - 1].box);
+        acc_count += bins[split - 1].count;
+        Real cost = acc_count * acc.Area() + right_cost[split];
+        if (cost < best_cost) {
+          best_cost = cost;
+          best_axis = axis;
+          best_split = split;
+        }
+      }
+    }
+    if (best_axis < 0) return;  // All centers coincide.
+    const Real area = box.Area();
+    best_cost = kTraversalCost + ((area > 0) ? best_cost / area : 0);
+    if (count <= kMaxLeafSize && best_cost >= count) return;
+
+    const Real lo = cbox.lo[best_axis];
+    const Real scale = kBins / (cbox.hi[best_axis] - lo);
+    int* mid = std::partition(
+        index_.data() + begin, index_.data() + end, [&](int i) {
+          const Real c = centers[i][best_axis];
+          return std::min(kBins - 1, int((c - lo) * scale)) < best_split;
+        });
+    const int m = mid - index_.data();
+    if (m == begin || m == end) return;
+
+    const int left = nodes_.size();
+    nodes_.emplace_back();
+    nodes_.emplace_back();
+    nodes_[n].first = left;
+    nodes_[n].count = 0;
+    Subdivide(left, begin, m, depth + 1, boxes, centers);
+    Subdivide(left + 1, m, end, depth + 1, boxes, centers);
+  }
+
+  std::vector<Node> nodes_;
+  std::vector<int> index_;
+};
+
+// Primitives sorted by concrete type into structure-of-arrays buffers, so
+// each type is intersected by a tight loop without virtual calls. Objects of
+// other types fall back to Object::Intersect().
+class PrimitiveGroups {
+ public:
+  // The index of an object in objs is what Intersect() reports for it.
+  void Build(const std::vector<const Object*>& objs) {
+    *this = PrimitiveGroups();
+    for (int i = 0; i < objs.size(); ++i) {
+      const Object* o = objs[i];
+      if (auto* s = dynamic_cast<const Sphere*>(o)) {
+        spheres_.Add(i, s->center, s->radius);
+      } else if (auto* b = dynamic_cast<const Box*>(o)) {
+        boxes_.Add(i, b->lo, b->hi);
+      } else if (auto* p = dynamic_cast<const LeftPlane*>(o)) {
+        rects_x_.Add(i, p->x, p->yz1, p->yz2);
+      } else if (auto* p = dynamic_cast<const RightPlane*>(o)) {
+        rects_x_.Add(i, p->x, p->yz1, p->yz2);
+      } else if (auto* p = dynamic_cast<const BtmPlane*>(o)) {
+        rects_y_.Add(i, p->y, p->xz1, p->xz2);
+      } else if (auto* p = dynamic_cast<const TopPlane*>(o)) {
+        rects_y_.Add(i, p->y, p->xz1, p->xz2);
+      } else if (auto* p = dynamic_cast<const FwdPlane*>(o)) {
+        rects_z_.Add(i, p->z, p->xy1, p->xy2);
+      } else if (auto* p = dynamic_cast<const BackPlane*>(o)) {
+        rects_z_.Add(i, p->z, p->xy1, p->xy2);
+      } else {
+        others_.push_back(Other{i, o});
+      }
+    }
+  }
+
+  // Returns the index of the closest object hit, or -1 on a miss. Exact ties
+  // go to the lowest index.
+  int Intersect(const Ray& r, Real* dist) const {
+    Real best = std::numeric_limits<Real>::infinity();
+    int best_i = -1;
+    Closest(spheres_, r, &best, &best_i);
+    Closest(boxes_, r, &best, &best_i);
+    Closest(rects_x_, r, &best, &best_i);
+    Closest(rects_y_, r, &best, &best_i);
+    Closest(rects_z_, r, &best, &best_i);
+    for (const auto& o : others_) {
+      Closer(o.obj->Intersect(r), o.index, &best, &best_i);
+    }
+    *dist = best;
+    return best_i;
+  }
+
+  // Is any object hit before max_dist? Returns at the first one found.
+  bool Occluded(const Ray& r, Real max_dist) const {
+    if (Any(spheres_, r, max_dist) || Any(boxes_, r, max_dist) ||
+        Any(rects_x_, r, max_dist) || Any(rects_y_, r, max_dist) ||
+        Any(rects_z_, r, max_dist)) {
+      return true;
+    }
+    for (const auto& o : others_) {
+      Real d = o.obj->Intersect(r);
+      if (d > 0 && d < max_dist) return true;
+    }
+    return false;
+  }
+
+  // Packet version of Intersect(): fills dist[] and index[] for every lane,
+  // index is -1 on a miss.
+  void IntersectPacket(const RayPacket& p, Real* dist,
+                       int64_t* index) const {
+    for (int l = 0; l < RayPacket::kSize; ++l) {
+      dist[l] = std::numeric_limits<Real>::infinity();
+      index[l] = -1;
+    }
+    spheres_.IntersectPacket(p, dist, index);
+    boxes_.IntersectPacket(p, dist, index);
+    rects_x_.IntersectPacket(p, dist, index);
+    rects_y_.IntersectPacket(p, dist, index);
+    rects_z_.IntersectPacket(p, dist, index);
+    for (const auto& o : others_) {
+      Real d[RayPacket::kSize];
+      for (int l = 0; l < RayPacket::kSize; ++l) {
+        d[l] = (l < p.n) ? o.obj->Intersect(p.ray(l)) : -1;
+      }
+      CloserLanes(d, o.index, dist, index);
+    }
+  }
+
+ private:
+  static constexpr int kBlock = 32;
+
+  static void Closer(Real d, int i, Real* best, int* best_i) {
+    if (d > 0 && (d < *best || (d == *best && i < *best_i))) {
+      *best = d;
+      *best_i = i;
+    }
+  }
+
+  // Closest hit in group g. Distances are computed a block at a time, so the
+  // compiler can vectorize that loop.
+  template <typename G>
+  static void Closest(const G& g, const Ray& r, Real* best, int* best_i) {
+    const int n = g.index.size();
+    Real dist[kBlock];
+    for (int begin = 0; begin < n; begin += kBlock) {
+      const int end = std::min(n, begin + kBlock);
+      g.Distances(r, begin, end, dist);
+      for (int i = begin; i < end; ++i) {
+        Closer(dist[i - begin], g.index[i], best, best_i);
+      }
+    }
+  }
+
+  // Is anything in group g hit before max_dist? Stops after the first block
+  // with a hit.
+  template <typename G>
+  static bool Any(const G& g, const Ray& r, Real max_dist) {
+    const int n = g.index.size();
+    Real dist[kBlock];
+    for (int begin = 0; begin < n; begin += kBlock) {
+      const int end = std::min(n, begin + kBlock);
+      g.Distances(r, begin, end, dist);
+      bool any = false;
+      for (int i = 0; i < end - begin; ++i) {
+        any |= dist[i] > 0 && dist[i] < max_dist;
+      }
+      if (any) return true;
+    }
+    return false;
+  }
+
+  // Closer() for every lane of a packet, without branches.
+  static void CloserLanes(const Real* d, int64_t i, Real* best,
+                          int64_t* best_i) {
+    for (int l = 0; l < RayPacket::kSize; ++l) {
+      bool closer =
+          d[l] > 0 && (d[l] < best[l] || (d[l] == best[l] && i < best_i[l]));
+      best[l] = closer ? d[l] : best[l];
+      best_i[l] = closer ? i : best_i[l];
+    }
+  }
+
+  struct Spheres {
+    void Add(int i, const vec3& c, Real r) {
+      index.push_back(i);
+      cx.push_back(c.x);
+      cy.push_back(c.y);
+      cz.push_back(c.z);
+      r2.push_back(sqr(r));
+    }
+
+    // Same math as Sphere::Intersect(), without branches like Boxes.
+    void Distances(const Ray& r, int begin, int end, Real* dist) const {
+      const Real a = dot(r.dir, r.dir);
+      for (int i = begin; i < end; ++i) {
+        vec3 ec = r.start - vec3{cx[i], cy[i], cz[i]};
+        Real b = 2 * dot(r.dir, ec);
+        Real c = dot(ec, ec) - r2[i];
+        Real det = b * b - 4 * a * c;
+        Real d = (-b - std::sqrt(std::fmax(det, Real(0)))) / (2 * a);
+        dist[i - begin] = (det < 0) ? -1 : d;
+      }
+    }
+
+    void IntersectPacket(const RayPacket& p, Real* best,
+                         int64_t* best_i) const {
+      Real a[RayPacket::kSize];
+      for (int l = 0; l < RayPacket::kSize; ++l) {
+        a[l] = sqr(p.dir[0][l]) + sqr(p.dir[1][l]) + sqr(p.dir[2][l]);
+      }
+      for (int i = 0; i < index.size(); ++i) {
+        Real d[RayPacket::kSize];
+        for (int l = 0; l < RayPacket::kSize; ++l) {
+          Real ex = p.start[0][l] - cx[i];
+          Real ey = p.start[1][l] - cy[i];
+          Real ez = p.start[2][l] - cz[i];
+          Real b =
+              2 * (p.dir[0][l] * ex + p.dir[1][l] * ey + p.dir[2][l] * ez);
+          Real c = ex * ex + ey * ey + ez * ez - r2[i];
+          Real det = b * b - 4 * a[l] * c;
+          Real t = (-b - std::sqrt(std::fmax(det, Real(0)))) / (2 * a[l]);
+          d[l] = (det < 0) ? -1 : t;
+        }
+        CloserLanes(d, index[i], best, best_i);
+      }
+    }
+
+    std::vector<int> index;
+    std::vector<Real> cx, cy, cz, r2;
+  };
+
+  struct Boxes {
+    void Add(int i, const vec3& lo, const vec3& hi) {
+      index.push_back(i);
+      lox.push_back(lo.x);
+      loy.push_back(lo.y);
+      loz.push_back(lo.z);
+      hix.push_back(hi.x);
+      hiy.push_back(hi.y);
+      hiz.push_back(hi.z);
+    }
+
+    // Same math as Box::Intersect(), for boxes [begin, end). Without
+    // branches, so the compiler can vectorize the loop.
+    void Distances(const Ray& r, int begin, int end, Real* dist) const {
+      const vec3 inv_dir{1 / r.dir.x, 1 / r.dir.y, 1 / r.dir.z};
+      for (int i = begin; i < end; ++i) {
+        vec3 t0 = (vec3{lox[i], loy[i], loz[i]} - r.start) * inv_dir;
+        vec3 t1 = (vec3{hix[i], hiy[i], hiz[i]} - r.start) * inv_dir;
+        vec3 tmin = min(t0, t1);
+        vec3 tmax = max(t0, t1);
+        Real enter = std::fmax(std::fmax(tmin.x, tmin.y), tmin.z);
+        Real leave = std::fmin(std::fmin(tmax.x, tmax.y), tmax.z);
+        Real d = (enter > 0) ? enter : leave;
+        dist[i - begin] = (enter > leave) ? -1 : d;
+      }
+    }
+
+    void IntersectPacket(const RayPacket& p, Real* best,
+                         int64_t* best_i) const {
+      for (int i = 0; i < index.size(); ++i) {
+        const Real lo[3] = {lox[i], loy[i], loz[i]};
+        const Real hi[3] = {hix[i], hiy[i], hiz[i]};
+        Real d[RayPacket::kSize];
+        for (int l = 0; l < RayPacket::kSize; ++l) {
+          Real enter = -std::numeric_limits<Real>::infinity();
+          Real leave = std::numeric_limits<Real>::infinity();
+          for (int axis = 0; axis < 3; ++axis) {
+            Real t0 = (lo[axis] - p.start[axis][l]) * p.inv_dir[axis][l];
+            Real t1 = (hi[axis] - p.start[axis][l]) * p.inv_dir[axis][l];
+            enter = std::fmax(enter, std::fmin(t0, t1));
+            leave = std::fmin(leave, std::fmax(t0, t1));
+          }
+          Real t = (enter > 0) ? enter : leave;
+          d[l] = (enter > leave) ? -1 : t;
+        }
+        CloserLanes(d, index[i], best, best_i);
+      }
+    }
+
+    std::vector<int> index;
+    std::vector<Real> lox, loy, loz, hix, hiy, hiz;
+  };
+
+  // Axis-aligned rectangles, perpendicular to kAxis. (u, v) are the other
+  // two axes, in xyz order.
+  template <int kAxis>
+  struct Rects {
+    void Add(int i, Real p, const vec2& uv1, const vec2& uv2) {
+      index.push_back(i);
+      pos.push_back(p);
+      u1.push_back(uv1.x);
+      v1.push_back(uv1.y);
+      u2.push_back(uv2.x);
+      v2.push_back(uv2.y);
+    }
+
+    // Same math as the *Plane::Intersect() functions, without branches like
+    // Boxes.
+    void Distances(const Ray& r, int begin, int end, Real* dist) const {
+      for (int i = begin; i < end; ++i) {
+        Real d = (pos[i] - r.start[kAxis]) / r.dir[kAxis];
+        Real u = r.start[kU] + r.dir[kU] * d;
+        Real v = r.start[kV] + r.dir[kV] * d;
+        // Is it outside the rectangle?
+        bool out = u < u1[i] || v < v1[i] || u > u2[i] || v > v2[i];
+        dist[i - begin] = out ? -1 : d;
+      }
+    }
+
+    void IntersectPacket(const RayPacket& p, Real* best,
+                         int64_t* best_i) const {
+      for (int i = 0; i < index.size(); ++i) {
+        Real d[RayPacket::kSize];
+        for (int l = 0; l < RayPacket::kSize; ++l) {
+          Real t = (pos[i] - p.start[kAxis][l]) / p.dir[kAxis][l];
+          Real u = p.start[kU][l] + p.dir[kU][l] * t;
+          Real v = p.start[kV][l] + p.dir[kV][l] * t;
+          bool out = u < u1[i] || v < v1[i] || u > u2[i] || v > v2[i];
+          d[l] = out ? -1 : t;
+        }
+        CloserLanes(d, index[i], best, best_i);
+      }
+    }
+
+    static constexpr int kU = (kAxis == 0) ? 1 : 0;
+    static constexpr int kV = (kAxis == 2) ? 1 : 2;
+
+    std::vector<int> index;
+    std::vector<Real> pos, u1, v1, u2, v2;
+  };
+
+  struct Other {
+    int index;
+    const Object* obj;
+  };
+
+  Spheres spheres_;
+  Boxes boxes_;
+  Rects<0> rects_x_;
+  Rects<1> rects_y_;
+  Rects<2> rects_z_;
+  std::vector<Other> others_;
+};
+
+// A ray that a Shader wants traced, and how much of what comes back along it
+// ends up in the shaded color.
+struct Bounce {
+  Ray ray;
+  vec3 weight;
+  Rng rng;
+  // Solid-angle density the direction was sampled with, for multiple
+  // importance sampling against light sampling. Zero if it wasn't sampled
+  // from a density.
+  Real pdf = 0;
+  // Shadow rays carry light from a point on a light, at distance 1 along the
+  // ray. The weight counts in full if nothing is in the way, they aren't
+  // traced further.
+  bool shadow = false;
+};
+
+// Lights that shading samples directly (next-event estimation): elements with
+// light shaders and a surface that can be sampled. A light is picked
+// uniformly, then a point on it uniformly by area.
+class Lights {
+ public:
+  void Add(const Object* obj, const vec3& color) {
+    lights_.push_back(Light{obj, color, obj->Area()});
+  }
+
+  bool empty() const { return lights_.empty(); }
+
+  // Picks a point on a light to shade p with. Writes the shadow ray from p,
+  // which reaches the light at distance 1, the light's color, and the
+  // solid-angle density of the pick as seen from p. Returns false if the
+  // point is useless, e.g. seen edge-on.
+  bool Sample(Rng& rng, const vec3& p, Ray* ray, vec3* color,
+              Real* pdf) const {
+    const int i = std::min(int(rng.rand() * lights_.size()),
+                           int(lights_.size()) - 1);
+    const Light& light = lights_[i];
+    const vec2 uv{rng.rand(), rng.rand()};
+    *ray = Ray{p, light.obj->SamplePoint(uv) - p};
+    *color = light.color;
+    *pdf = SolidAnglePdf(light, *ray, 1.);
+    return *pdf > 0;
+  }
+
+  // Solid-angle density that Sample() picks the point where r hits obj at
+  // dist, from r's start. Zero if obj isn't one of the lights.
+  Real Pdf(const Object* obj, const Ray& r, Real dist) const {
+    for (const Light& light : lights_) {
+      if (light.obj == obj) return SolidAnglePdf(light, r, dist);
+    }
+    return 0;
+  }
+
+  // Power heuristic weight for a sample from a strategy with density pdf,
+  // against another with density other.
+  static Real MisWeight(Real pdf, Real other) {
+    return sqr(pdf) / (sqr(pdf) + sqr(other));
+  }
+
+ private:
+  struct Light {
+    const Object* obj;
+    vec3 color;
+    Real area;
+  };
+
+  Real SolidAnglePdf(const Light& light, const Ray& r, Real dist) const {
+    const vec3 q = r.p(dist);
+    const Real len = length(r.dir);
+    // Lights are two-sided.
+    const Real cos_light = std::fabs(dot(light.obj->Normal(q), r.dir)) / len;
+    if (cos_light <= 0) return 0;
+    return sqr(dist * len) / (cos_light * light.area * lights_.size());
+  }
+
+  std::vector<Light> lights_;
+};
+
 class Tracer {
  public:
-  // Returns a color.
-  virtual vec3 Trace(const Random& rng, const Ray& r, int level) const = 0;
+  // Returns a color. pdf is the solid-angle density r's direction was
+  // sampled with, or zero (see Bounce).
+  virtual vec3 Trace(const Rng& rng, const Ray& r, int level,
+                     Real pdf) const = 0;
+
+  // Is anything hit along r before max_dist?
+  virtual bool Occluded(const Ray& r, Real max_dist) const = 0;
+
+  virtual int max_level() const = 0;
+  virtual const Lights& lights() const = 0;
 };
 
 class Shader {
  public:
-  vec3 Shade(const Random& rng_in, const Tracer* t, const Object* obj,
-             const Ray& r, double dist, int level) const {
+  static constexpr int kMaxBounces = 3;
+
+  vec3 Shade(const Rng& rng_in, const Tracer* t, const Object* obj,
+             const Ray& r, Real dist, int level, Real pdf) const {
     if (light) {
-      return color;
+      return color * LightWeight(t->lights(), obj, r, dist, pdf);
     }
     vec3 out{0, 0, 0};
-    vec3 p = r.p(dist);
-    vec3 n = obj->Normal(p);
+    if (level + 1 > t->max_level()) {
+      // Nothing comes back from the next level.
+      return out;
+    }
+    Bounce bounces[kMaxBounces];
+    const int n = Scatter(rng_in, obj, r, dist, t->lights(), bounces);
+    for (int i = 0; i < n; ++i) {
+      const Bounce& b = bounces[i];
+      if (b.shadow) {
+        if (!t->Occluded(b.ray, kShadowEnd)) out += b.weight;
+      } else {
+        out += b.weight * t->Trace(b.rng, b.ray, level + 1, b.pdf);
+      }
+    }
+    return out;
+  }
+
+  // How much of this light's color counts when a ray sampled with density pdf
+  // hits it at dist: light sampling covers the rest.
+  static Real LightWeight(const Lights& lights, const Object* obj,
+                            const Ray& r, Real dist, Real pdf) {
+    if (pdf <= 0) return 1;
+    const Real light_pdf = lights.Pdf(obj, r, dist);
+    if (light_pdf <= 0) return 1;
+    return Lights::MisWeight(pdf, light_pdf);
+  }
+
+  // Shadow rays are occluded by anything before this distance. Short of 1, so
+  // the light itself doesn't count.
+  static constexpr Real kShadowEnd = 1 - kTiny;
+
+  // Scattered rays start this far off the surface, along the normal. Without
+  // it, rounding makes many of them hit the surface they start on.
+  static constexpr Real kOffset = kTiny;
+
+  // Writes the rays to trace from a hit to out, returns how many there are.
+  // Lights don't scatter, their color is what they return.
+  int Scatter(const Rng& rng_in, const Object* obj, const Ray& r,
+              Real dist, const Lights& lights, Bounce* out) const {
+    int count = 0;
+    vec3 n = obj->Normal(r.p(dist));
+    vec3 p = r.p(dist) + n * kOffset;
 
     if (diffuse > 0) {
-      // Pick random direction.
-      vec3 d;
-      double shade;
-      Random rng = rng_in.fork(1);
-      do {
-        d = vec3{rng.rand(), rng.rand(), rng.rand()} - vec3{.5, .5, .5};
-        d = normalize(d);
-        shade = dot(n, d);
-      } while (shade <= 0);
+      // Pick a cosine-weighted random direction. The cosine term and the pdf
+      // cancel, leaving a constant weight. The half keeps the brightness of
+      // the old estimator, which was weighted by the cosine over a uniform
+      // hemisphere.
+      Rng rng = rng_in.fork(1);
+      vec3 local = vec3::cosine_hemisphere(rng);
+      vec3 d = Onb(n).ToWorld(local);
+      out[count++] = Bounce{Ray{p, d}, color * diffuse * .5, rng_in.fork(2),
+                            /*pdf=*/local.z / Real(M_PI)};
+    }
 
-      // Trace.
-      vec3 incoming = t->Trace(rng_in.fork(2), Ray{p, d}, level + 1);
-      out += color * diffuse * shade * incoming;
+    if (diffuse > 0 && !lights.empty()) {
+      // Sample a light directly.
+      Rng rng = rng_in.fork(4);
+      Ray shadow;
+      vec3 light_color;
+      Real light_pdf;
+      if (lights.Sample(rng, p, &shadow, &light_color, &light_pdf)) {
+        const Real cos_p = dot(n, shadow.dir) / length(shadow.dir);
+        if (cos_p > 0) {
+          // Same BRDF as the diffuse bounce above: color * diffuse * .5 / pi.
+          const Real bsdf_pdf = cos_p / Real(M_PI);
+          const Real w = Lights::MisWeight(light_pdf, bsdf_pdf);
+          out[count++] =
+              Bounce{shadow,
+                     color * diffuse * .5 * light_color *
+                         (bsdf_pdf / light_pdf * w),
+                     rng, /*pdf=*/0, /*shadow=*/true};
+        }
+      }
     }
 
     if (reflection > 0) {
       // Perturb the normal to blur the reflection.
-      double amount = 0.03;
-      Random rng = rng_in.fork(3);
+      Real amount = 0.03;
+      Rng rng = rng_in.fork(3);
       vec3 n2 =
           n + (vec3{rng.rand(), rng.rand(), rng.rand()} - vec3{.5, .5, .5}) *
                   amount;
       n2 = normalize(n2);
-      Ray refray{p, reflect(p - r.start, n2)};
-      out += color * reflection * t->Trace(rng, refray, level + 1);
+      Ray refray{p, reflect(r.dir, n2)};
+      out[count++] = Bounce{refray, color * reflection, rng};
     }
 
-    return out;
+    return count;
   }
 
   Shader& set_color(vec3 c) {
     color = c;
     return *this;
   }
-  Shader& set_diffuse(double d) {
+  Shader& set_diffuse(Real d) {
     diffuse = d;
     return *this;
   }
-  Shader& set_reflection(double d) {
+  Shader& set_reflection(Real d) {
     reflection = d;
     return *this;
   }
@@ -407,8 +1392,8 @@ class Shader {
   }
 
   vec3 color{1, 1, 1};
-  double diffuse = 1.;
-  double reflection = 0;
+  Real diffuse = 1.;
+  Real reflection = 0;
   bool checker = false;
   bool light = false;
 };
@@ -422,12 +1407,22 @@ class Scene : public Tracer {
   };
 
   struct Hit {
-    double dist;
+    Real dist;
     const Elem* elem;  // Miss = nullptr.
   };
 
+  // How Intersect() searches the elements.
+  enum class Accel {
+    kLinear,  // Every element, with virtual calls.
+    kBVH,     // Bounding volume hierarchy.
+    kSoA,     // Every element, sorted by type into PrimitiveGroups.
+  };
+
   Scene(int max_level) : max_level_(max_level) {}
 
+  int max_level() const override { return max_level_; }
+  const Lights& lights() const override { return lights_; }
+
   // Takes ownership of object.
   void AddElem(Object* o, const Shader& s) {
     elems_.emplace_back(o, s);
@@ -435,25 +1430,56 @@ class Scene : public Tracer {
   }
 
   void AddBox(const vec3& xyz1, const vec3& xyz2, const Shader& s) {
-    AddElem(new RightPlane(xyz1.x, xyz1.yz(), xyz2.yz()), s);
-    AddElem(new LeftPlane(xyz2.x, xyz1.yz(), xyz2.yz()), s);
-    AddElem(new TopPlane(xyz1.y, xyz1.xz(), xyz2.xz()), s);
-    AddElem(new BtmPlane(xyz2.y, xyz1.xz(), xyz2.xz()), s);
-    AddElem(new BackPlane(xyz1.z, xyz1.xy(), xyz2.xy()), s);
-    AddElem(new FwdPlane(xyz2.z, xyz1.xy(), xyz2.xy()), s);
+    AddElem(new Box(xyz1, xyz2), s);
   }
 
   void AddRoom(const vec3& xyz1, const vec3& xyz2, const Shader& s) {
     // A box with normals inverted.
-    AddElem(new LeftPlane(xyz1.x, xyz1.yz(), xyz2.yz()), s);
-    AddElem(new RightPlane(xyz2.x, xyz1.yz(), xyz2.yz()), s);
-    AddElem(new BtmPlane(xyz1.y, xyz1.xz(), xyz2.xz()), s);
-    AddElem(new TopPlane(xyz2.y, xyz1.xz(), xyz2.xz()), s);
-    AddElem(new FwdPlane(xyz1.z, xyz1.xy(), xyz2.xy()), s);
-    AddElem(new BackPlane(xyz2.z, xyz1.xy(), xyz2.xy()), s);
+    AddElem(new Box(xyz1, xyz2, /*inverted=*/true), s);
   }
 
-  vec3 Trace(const Random& rng, const Ray& r, int level) const override {
+  // Builds the acceleration structure, and the list of lights to sample if
+  // sample_lights. Call this after the last AddElem(), the scene must not be
+  // changed afterwards. Until then, Intersect() tests every element.
+  void Finalize(Accel accel = Accel::kBVH, bool sample_lights = true) {
+    lights_ = Lights();
+    if (sample_lights) {
+      for (const auto& e : elems_) {
+        if (e.shader.light && e.obj->Area() > 0) {
+          lights_.Add(e.obj, e.shader.color);
+        }
+      }
+    }
+    accel_ = accel;
+    if (accel == Accel::kLinear) return;
+    if (accel == Accel::kSoA) {
+      std::vector<const Object*> objs;
+      for (const auto& e : elems_) objs.push_back(e.obj);
+      groups_.Build(objs);
+      return;
+    }
+    // Pad the boxes a little: planes have zero thickness, and rays that start
+    // on a surface shouldn't get lost to rounding.
+    constexpr Real kPad = kTiny / 10;
+    std::vector<AABB> boxes;
+    bounded_.clear();
+    unbounded_.clear();
+    for (int i = 0; i < elems_.size(); ++i) {
+      AABB b = elems_[i].obj->Bounds();
+      if (b.IsFinite()) {
+        b.lo -= vec3{kPad, kPad, kPad};
+        b.hi += vec3{kPad, kPad, kPad};
+        boxes.push_back(b);
+        bounded_.push_back(i);
+      } else {
+        unbounded_.push_back(i);
+      }
+    }
+    bvh_.Build(boxes);
+  }
+
+  vec3 Trace(const Rng& rng, const Ray& r, int level,
+             Real pdf) const override {
     if (level > max_level_) {
       // Terminate recursion.
       return vec3{0, 0, 0};
@@ -462,24 +1488,126 @@ class Scene : public Tracer {
     if (h.elem == nullptr) {
       return {0, 0, 0};
     }
-    return h.elem->shader.Shade(rng, this, h.elem->obj, r, h.dist, level);
+    return h.elem->shader.Shade(rng, this, h.elem->obj, r, h.dist, level, pdf);
   }
 
- private:
+  // Is anything hit along r before max_dist? Returns at the first hit found,
+  // which need not be the closest.
+  bool Occluded(const Ray& r, Real max_dist) const override {
+    auto hit = [&r, max_dist](const Elem& e) {
+      Real d = e.obj->Intersect(r);
+      return d > 0 && d < max_dist;
+    };
+    if (accel_ == Accel::kLinear) {
+      for (const auto& e : elems_) {
+        if (hit(e)) return true;
+      }
+      return false;
+    }
+    if (accel_ == Accel::kSoA) return groups_.Occluded(r, max_dist);
+    for (int i : unbounded_) {
+      if (hit(elems_[i])) return true;
+    }
+    return bvh_.Any(r, max_dist,
+                    [this, &hit](int i) { return hit(elems_[bounded_[i]]); });
+  }
+
+  // Same as calling Trace() on every ray of the packet, but the packet is
+  // intersected all at once. Shading is still one ray at a time. rngs[l] goes
+  // with lane l.
+  void TracePacket(const Rng* rngs, const RayPacket& p, int level,
+                   vec3* out) const {
+    if (level > max_level_) {
+      for (int l = 0; l < p.n; ++l) out[l] = vec3{0, 0, 0};
+      return;
+    }
+    Hit hits[RayPacket::kSize];
+    IntersectPacket(p, hits);
+    for (int l = 0; l < p.n; ++l) {
+      const Hit& h = hits[l];
+      if (h.elem == nullptr) {
+        out[l] = vec3{0, 0, 0};
+        continue;
+      }
+      out[l] = h.elem->shader.Shade(rngs[l], this, h.elem->obj, p.ray(l),
+                                    h.dist, level, /*pdf=*/0);
+    }
+  }
+
+  // Returns the closest hit.
   Hit Intersect(const Ray& ray) const {
     Hit h{-1, nullptr};
-    for (const auto& e : elems_) {
-      double d = e.obj->Intersect(ray);
-      if (Before(d, h.dist)) {
-        h.dist = d;
-        h.elem = &e;
-      }
+    if (accel_ == Accel::kLinear) {
+      for (const auto& e : elems_) Consider(ray, e, &h);
+      return h;
+    }
+    if (accel_ == Accel::kSoA) {
+      Real dist;
+      int i = groups_.Intersect(ray, &dist);
+      if (i >= 0) h = Hit{dist, &elems_[i]};
+      return h;
     }
+    for (int i : unbounded_) Consider(ray, elems_[i], &h);
+    const Real max_dist = (h.elem == nullptr)
+                                ? std::numeric_limits<Real>::infinity()
+                                : h.dist;
+    bvh_.Traverse(ray, max_dist, [this, &ray, &h](int i, Real max_dist) {
+      Consider(ray, elems_[bounded_[i]], &h);
+      return (h.elem == nullptr) ? max_dist : h.dist;
+    });
     return h;
   }
 
+  // Closest hit for every active lane of the packet.
+  void IntersectPacket(const RayPacket& p, Hit* hits) const {
+    if (accel_ == Accel::kLinear) {
+      for (int l = 0; l < p.n; ++l) hits[l] = Intersect(p.ray(l));
+      return;
+    }
+    if (accel_ == Accel::kSoA) {
+      Real dist[RayPacket::kSize];
+      int64_t index[RayPacket::kSize];
+      groups_.IntersectPacket(p, dist, index);
+      for (int l = 0; l < p.n; ++l) {
+        hits[l] = (index[l] < 0) ? Hit{-1, nullptr}
+                                 : Hit{dist[l], &elems_[index[l]]};
+      }
+      return;
+    }
+    Ray rays[RayPacket::kSize];
+    Real max_dist[RayPacket::kSize];
+    for (int l = 0; l < RayPacket::kSize; ++l) {
+      max_dist[l] = -1;  // Inactive lane.
+      if (l >= p.n) continue;
+      rays[l] = p.ray(l);
+      hits[l] = Hit{-1, nullptr};
+      for (int i : unbounded_) Consider(rays[l], elems_[i], &hits[l]);
+      max_dist[l] = (hits[l].elem == nullptr)
+                        ? std::numeric_limits<Real>::infinity()
+                        : hits[l].dist;
+    }
+    bvh_.TraversePacket(p, max_dist, [&](int i) {
+      const Elem& e = elems_[bounded_[i]];
+      for (int l = 0; l < p.n; ++l) {
+        Consider(rays[l], e, &hits[l]);
+        if (hits[l].elem != nullptr) max_dist[l] = hits[l].dist;
+      }
+    });
+  }
+
+ private:
+  // Updates h if e is hit before it. Exact ties go to the element that was
+  // added first, so the result doesn't depend on the order of the search.
+  static void Consider(const Ray& ray, const Elem& e, Hit* h) {
+    Real d = e.obj->Intersect(ray);
+    if (Before(d, h->dist) || (d > 0 && d == h->dist && &e < h->elem)) {
+      h->dist = d;
+      h->elem = &e;
+    }
+  }
+
   // Does a hit before b?
-  static bool Before(double a, double b) {
+  static bool Before(Real a, Real b) {
     if (a > 0 && b > 0 && a < b) return true;
     if (a > 0 && b < 0) return true;
     return false;
@@ -488,4 +1616,13 @@ class Scene : public Tracer {
   std::vector<Elem> elems_;
   std::vector<std::unique_ptr<Object>> objs_;
   const int max_level_;
+
+  // Built by Finalize(). With kBVH, bounded elements live in the BVH and the
+  // rest (e.g. Ground) are tested against every ray.
+  Accel accel_ = Accel::kLinear;
+  PrimitiveGroups groups_;
+  BVH bvh_;
+  std::vector<int> bounded_;    // BVH primitive index -> elems_ index.
+  std::vector<int> unbounded_;  // Into elems_.
+  Lights lights_;
 };
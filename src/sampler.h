@@ -0,0 +1,208 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+
+#include "random.h"
+
+namespace {
+
+// Dimension 1 of the Sobol sequence, whose direction numbers come from the
+// polynomial x + 1, as the XOR of one table entry per byte of the index.
+struct SobolTable {
+  constexpr SobolTable() : t() {
+    uint32_t v = 1u << 31;
+    for (int bit = 0; bit < 32; ++bit) {
+      for (uint32_t x = 0; x < 256; ++x) {
+        if (x & (1u << (bit % 8))) t[bit / 8][x] ^= v;
+      }
+      v ^= v >> 1;
+    }
+  }
+  uint32_t t[4][256];
+};
+constexpr SobolTable kSobol1;
+
+}  // namespace
+
+// Source of the numbers a sample uses: pixel jitter, lens position, bounce
+// directions and so on. Each call to rand() draws the next dimension.
+//
+// Like CounterRandom, a Sampler is a key plus a counter, and fork() hashes a
+// mixin into the key. What's new is the sample index: ForSample() picks which
+// sample of the pixel this is, and the kind decides how the samples of a pixel
+// relate to each other in every dimension:
+//
+//   kIndependent: unrelated random numbers, same as CounterRandom.
+//   kStratified:  consecutive pairs of dimensions are jittered on a grid of
+//                 about count cells, visited in a random order.
+//   kSobol:       consecutive pairs of dimensions are the first two dimensions
+//                 of the Sobol sequence, shuffled and Owen-scrambled with
+//                 seeds hashed from the key and the pair (Burley 2020,
+//                 "Practical Hash-based Owen Scrambling").
+//
+// Pairs are what the renderer draws (pixel xy, lens xy, hemisphere xy), and
+// padding them with independently scrambled 2D sequences means no table of
+// Sobol direction numbers is needed for high dimensions.
+class Sampler {
+ public:
+  enum class Kind : uint8_t {
+    kIndependent,
+    kStratified,
+    kSobol,
+  };
+
+  Sampler() : Sampler(Kind::kIndependent, 1) {}
+
+  // count is how many samples each pixel will get, it sets the grid size for
+  // kStratified.
+  Sampler(Kind kind, uint32_t count)
+      : key_(CounterRandom::Mix(1)), kind_(kind), index_(0), dim_(0) {
+    // Smallest square grid with at least count cells.
+    side_ = 1;
+    while (side_ * side_ < count) ++side_;
+  }
+
+  // Returns a number in the range [0, 1) for the next dimension.
+  double rand() {
+    const uint32_t c = dim_ % 2;
+    ++dim_;
+    if (kind_ == Kind::kIndependent) {
+      return ToDouble(CounterRandom::Mix(key_ + Hash(index_, dim_) *
+                                                    CounterRandom::kGamma));
+    }
+    if (c == 0) StartPair();
+    if (kind_ == Kind::kStratified) return Stratified(c);
+    return Sobol(c);
+  }
+
+  // Returns a new sampler with the new mixin added. It keeps the sample
+  // index and starts over at dimension zero, its dimensions are scrambled
+  // independently of ours.
+  Sampler fork(uint64_t mixin) const {
+    Sampler out = *this;
+    out.key_ = (key_ ^ mixin) * 0xdc3eb94af8ab4c93ULL;
+    out.key_ ^= out.key_ >> 32;
+    out.dim_ = 0;
+    return out;
+  }
+
+  // Returns the sampler for sample index of this pixel.
+  Sampler ForSample(uint32_t index) const {
+    Sampler out = *this;
+    out.index_ = index;
+    out.dim_ = 0;
+    return out;
+  }
+
+ private:
+  static double ToDouble(uint64_t bits) {
+    bits &= 0x000FFFFFFFFFFFFFULL;
+    bits |= 0x3FF0000000000000ULL;
+    double d;
+    memcpy(&d, &bits, 8);
+    return d - 1.;
+  }
+
+  // 32 bits in [0, 1), exact in a double.
+  static double ToDouble32(uint32_t bits) { return bits * 0x1p-32; }
+
+  static uint32_t Hash(uint32_t a, uint32_t b) {
+    return uint32_t(CounterRandom::Mix((uint64_t(a) << 32) | b));
+  }
+
+  static uint32_t ReverseBits(uint32_t x) {
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0F0F0F0Fu) | ((x & 0x0F0F0F0Fu) << 4);
+    x = ((x >> 8) & 0x00FF00FFu) | ((x & 0x00FF00FFu) << 8);
+    return (x >> 16) | (x << 16);
+  }
+
+  // Hash that only lets bits affect higher bits, from Laine and Karras with
+  // the constants from Burley 2020. On bit-reversed input, it's an Owen
+  // scramble.
+  static uint32_t LaineKarras(uint32_t x, uint32_t seed) {
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return x;
+  }
+
+  static uint32_t OwenScramble(uint32_t x, uint32_t seed) {
+    return ReverseBits(LaineKarras(ReverseBits(x), seed));
+  }
+
+  // Dimension c of point i of the Sobol sequence. Dimension 0 is the van der
+  // Corput sequence.
+  static uint32_t SobolPoint(uint32_t i, uint32_t c) {
+    if (c == 0) return ReverseBits(i);
+    return kSobol1.t[0][i & 255] ^ kSobol1.t[1][(i >> 8) & 255] ^
+           kSobol1.t[2][(i >> 16) & 255] ^ kSobol1.t[3][i >> 24];
+  }
+
+  // Hashes the key and pair number into seed_, and picks this sample's point
+  // of the pair's sequence: both dimensions of a pair use the same one.
+  void StartPair() {
+    seed_ = Hash(uint32_t(key_ ^ (key_ >> 32)), dim_ / 2);
+    if (kind_ == Kind::kSobol) {
+      point_ = OwenScramble(index_, seed_);
+    } else {
+      const uint32_t cells = side_ * side_;
+      point_ = Permute(index_ % cells, cells, seed_);
+    }
+  }
+
+  double Sobol(uint32_t c) const {
+    return ToDouble32(OwenScramble(SobolPoint(point_, c), Hash(seed_, c + 1)));
+  }
+
+  // Returns a random permutation of i in [0, n), from Kensler 2013,
+  // "Correlated Multi-Jittered Sampling". Walks cycles until the hash lands
+  // in range.
+  static uint32_t Permute(uint32_t i, uint32_t n, uint32_t p) {
+    uint32_t w = n - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+    do {
+      i ^= p;
+      i *= 0xe170893du;
+      i ^= p >> 16;
+      i ^= (i & w) >> 4;
+      i ^= p >> 8;
+      i *= 0x0929eb3fu;
+      i ^= p >> 23;
+      i ^= (i & w) >> 1;
+      i *= 1 | p >> 27;
+      i *= 0x6935fa69u;
+      i ^= (i & w) >> 11;
+      i *= 0x74dcb303u;
+      i ^= (i & w) >> 2;
+      i *= 0x9e501cc3u;
+      i ^= (i & w) >> 2;
+      i *= 0xc860a3dfu;
+      i &= w;
+      i ^= i >> 5;
+    } while (i >= n);
+    return (i + p) % n;
+  }
+
+  double Stratified(uint32_t c) const {
+    const uint32_t pos = (c == 0) ? (point_ % side_) : (point_ / side_);
+    const double jitter = ToDouble32(Hash(seed_ ^ index_, c + 1));
+    return (pos + jitter) / side_;
+  }
+
+  uint64_t key_;
+  Kind kind_;
+  uint32_t side_;  // Of the kStratified grid.
+  uint32_t index_;
+  uint32_t dim_;
+  // Set by StartPair() for the current pair of dimensions.
+  uint32_t seed_ = 0;
+  uint32_t point_ = 0;  // Index into the Sobol sequence, or stratum.
+};
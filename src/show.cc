@@ -11,8 +11,10 @@
 
 #include <cstdio>
 #include <memory>
+#include <vector>
 
 #include "image.h"
+#include "tonemap.h"
 
 namespace {
 
@@ -208,16 +210,12 @@ void Show(const Image& img) {
   const int h = img.height_;
   std::unique_ptr<uint8_t[]> data(new uint8_t[w * h * 4]);
 
-  const double* src = img.data_.get();
-  uint8_t* dst = data.get();
-  for (int y = 0; y < h; ++y)
-    for (int x = 0; x < w; ++x) {
-      dst[0] = Image::from_float(src[2]);
-      dst[1] = Image::from_float(src[1]);
-      dst[2] = Image::from_float(src[0]);
-      dst += 4;
-      src += 3;
-    }
+  const Encoder encoder;
+  std::vector<double> scratch(w * 3);
+  for (int y = 0; y < h; ++y) {
+    encoder.RowBgra(img.Row(y, 0, w, scratch.data()), w,
+                    data.get() + y * w * 4);
+  }
 
   Show(w, h, data.get());
 }
@@ -2,18 +2,26 @@
 #include <signal.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <atomic>
+#include <cstring>
 #include <iostream>
 #include <memory>
 #include <thread>
 #include <vector>
 
+#include "deflate.h"
 #include "glviewer.h"
 #include "image.h"
+#include "imagewriter.h"
+#include "path.h"
 #include "random.h"
 #include "ray.h"
+#include "thread_pool.h"
+#include "tiles.h"
 #include "time.h"
-#include "writepng.h"
+#include "tonemap.h"
+#include "wavefront.h"
 
 namespace {
 
@@ -25,10 +33,37 @@ const char* opt_outfile = nullptr;  // Don't save.
 bool want_display = true;
 int runs = 1;
 int num_threads = 8;
+Scene::Accel accel = Scene::Accel::kBVH;
+
+enum class Engine {
+  kRecursive,  // One camera ray at a time.
+  kPacket,     // Camera rays in packets of RayPacket::kSize.
+  kWavefront,  // A scanline at a time, breadth-first.
+  kPath,       // One camera ray at a time, following a single path.
+};
+Engine engine = Engine::kRecursive;
+int tile_size = 0;  // Zero means whole scanlines.
+bool print_thread_stats = false;
+bool pin_threads = false;
+bool numa_first_touch = false;
+bool progressive = false;
+int rr_depth = 3;  // Path engine: Russian roulette after this many hits.
+double time_budget = 0;  // Seconds, for progressive mode. Zero means none.
+// Adaptive sampling: after kSamples, keep sampling a pixel until the standard
+// error of its luminance is below noise_threshold times the luminance, or it
+// has max_samples. Zero means off.
+double noise_threshold = 0;
+int max_samples = 64;
+bool sample_lights = true;  // Next-event estimation.
+Sampler::Kind sampler = Sampler::Kind::kSobol;
+int png_level = kDeflateDefaultLevel;  // Compression of the output file.
+ToneMap tone_map = ToneMap::kClamp;    // For the preview and PNG output.
+Image::Format image_format = Image::Format::kF64;  // Of the framebuffer.
+Encoder encoder;                       // Of the preview, with tone_map.
 
 void ProcessOpts(int argc, char** argv) {
   int c;
-  while ((c = getopt(argc, argv, "w:h:s:o:b:l:t:x")) != -1) {
+  while ((c = getopt(argc, argv, "w:h:s:o:b:l:t:xa:e:T:vPNpd:n:m:Er:S:c:M:F:")) != -1) {
     switch (c) {
       case 'w':
         kWidth = atoi(optarg);
@@ -55,10 +90,108 @@ void ProcessOpts(int argc, char** argv) {
       case 'x':
         want_display = false;
         break;
+      case 'a':
+        if (!strcmp(optarg, "linear")) {
+          accel = Scene::Accel::kLinear;
+        } else if (!strcmp(optarg, "bvh")) {
+          accel = Scene::Accel::kBVH;
+        } else if (!strcmp(optarg, "soa")) {
+          accel = Scene::Accel::kSoA;
+        } else {
+          std::cerr << "unknown accel \"" << optarg << "\"\n";
+        }
+        break;
+      case 'e':
+        if (!strcmp(optarg, "recursive")) {
+          engine = Engine::kRecursive;
+        } else if (!strcmp(optarg, "packet")) {
+          engine = Engine::kPacket;
+        } else if (!strcmp(optarg, "wavefront")) {
+          engine = Engine::kWavefront;
+        } else if (!strcmp(optarg, "path")) {
+          engine = Engine::kPath;
+        } else {
+          std::cerr << "unknown engine \"" << optarg << "\"\n";
+        }
+        break;
+      case 'T':
+        tile_size = atoi(optarg);
+        break;
+      case 'v':
+        print_thread_stats = true;
+        break;
+      case 'P':
+        pin_threads = true;
+        break;
+      case 'N':
+        numa_first_touch = true;
+        break;
+      case 'p':
+        progressive = true;
+        break;
+      case 'd':
+        time_budget = atof(optarg);
+        break;
+      case 'n':
+        noise_threshold = atof(optarg);
+        break;
+      case 'm':
+        max_samples = atoi(optarg);
+        break;
+      case 'E':
+        sample_lights = false;
+        break;
+      case 'r':
+        rr_depth = atoi(optarg);
+        break;
+      case 'S':
+        if (!strcmp(optarg, "independent")) {
+          sampler = Sampler::Kind::kIndependent;
+        } else if (!strcmp(optarg, "stratified")) {
+          sampler = Sampler::Kind::kStratified;
+        } else if (!strcmp(optarg, "sobol")) {
+          sampler = Sampler::Kind::kSobol;
+        } else {
+          std::cerr << "unknown sampler \"" << optarg << "\"\n";
+        }
+        break;
+      case 'c': {
+        const int level = atoi(optarg);
+        if (level >= 0 && level <= kDeflateMaxLevel) {
+          png_level = level;
+        } else {
+          std::cerr << "compression level must be 0 to " << kDeflateMaxLevel
+                    << "\n";
+        }
+        break;
+      }
+      case 'F':
+        if (!strcmp(optarg, "f64")) {
+          image_format = Image::Format::kF64;
+        } else if (!strcmp(optarg, "f32")) {
+          image_format = Image::Format::kF32;
+        } else if (!strcmp(optarg, "f16")) {
+          image_format = Image::Format::kF16;
+        } else {
+          std::cerr << "unknown framebuffer format \"" << optarg << "\"\n";
+        }
+        break;
+      case 'M':
+        if (!strcmp(optarg, "clamp")) {
+          tone_map = ToneMap::kClamp;
+        } else if (!strcmp(optarg, "reinhard")) {
+          tone_map = ToneMap::kReinhard;
+        } else if (!strcmp(optarg, "aces")) {
+          tone_map = ToneMap::kAces;
+        } else {
+          std::cerr << "unknown tone map \"" << optarg << "\"\n";
+        }
+        break;
       default:
         std::cerr << "error parsing cmdline flags\n";
     }
   }
+  encoder = Encoder(tone_map);
 }
 
 std::atomic<bool> running = true;
@@ -103,11 +236,12 @@ class MyScene : public Scene {
       AddElem(
           new Sphere({1., .5, .5}, .5),
           Shader().set_diffuse(.2).set_reflection(.8).set_color({.7, .8, .9}));
+    Finalize(accel, sample_lights);
   }
 };
 
-// Returns color.
-vec3 RenderPixel(const Tracer* t, Random& rng, const Lookat& look_at, vec2 xy) {
+// Returns the camera ray through pixel xy.
+Ray CameraRay(Rng& rng, const Lookat& look_at, vec2 xy) {
   // Antialiasing: jitter position within pixel.
   xy += vec2{rng.rand(), rng.rand()};
   // Map to [-aspect, +aspect] and [-1, +1].
@@ -121,57 +255,262 @@ vec3 RenderPixel(const Tracer* t, Random& rng, const Lookat& look_at, vec2 xy) {
   vec3 proj = kCamera + focal_dist * normalize(dir);
 
   // Focal blur: jitter camera position.
-  vec2 blur = vec2::uniform_disc(rng) * kAperture;
+  vec2 blur = vec2::uniform_disc3(rng) * kAperture;
   vec3 camera = kCamera + (look_at.right * blur.x) + (look_at.up * blur.y);
-  return t->Trace(rng, Ray{camera, proj - camera}, /*level=*/0);
+  return Ray{camera, proj - camera};
 }
 
-void RendererThread(std::atomic<int>* line, const Lookat& look_at,
-                    const MyScene& scene, const Random& rng, Image* out,
-                    uint8_t* view_data) {
-  while (1) {
-    const int y = line->fetch_add(1, std::memory_order_acq_rel);
-    if (y >= kHeight) return;
-    double* ptr = out->data_.get() + y * out->width_ * 3;
-    uint8_t* vdptr = view_data + y * out->width_ * 4;
-    Random rngy = rng.fork(y);
-    for (int x = 0; x < kWidth; ++x) {
+// Returns color.
+vec3 RenderPixel(const Tracer* t, Rng& rng, const Lookat& look_at, vec2 xy) {
+  Ray ray = CameraRay(rng, look_at, xy);
+  return t->Trace(rng, ray, /*level=*/0, /*pdf=*/0);
+}
+
+// Which samples a pass over the frame takes, and where it adds them up.
+struct Pass {
+  int s0, s1;  // Samples [s0, s1) of every pixel.
+  // Running sums of every pixel's samples, kWidth * kHeight of them. If null,
+  // each span starts from zero.
+  vec3d* sums;
+};
+
+// Adds samples [s0, s1) of pixels [x0, x1) of line y to sums[x0..x1), tracing
+// the camera rays in packets. Uses the same rngs, and adds in the same order,
+// as calling RenderPixel() for every sample.
+void SampleSpanPackets(const Scene& scene, const Rng& rngy,
+                       const Lookat& look_at, int y, int x0, int x1, int s0,
+                       int s1, vec3d* sums) {
+  Rng rngs[RayPacket::kSize];
+  Ray rays[RayPacket::kSize];
+  int xs[RayPacket::kSize];
+  int n = 0;
+  auto flush = [&]() {
+    vec3 out[RayPacket::kSize];
+    scene.TracePacket(rngs, RayPacket(rays, n), /*level=*/0, out);
+    for (int l = 0; l < n; ++l) sums[xs[l]] += out[l];
+    n = 0;
+  };
+  for (int x = x0; x < x1; ++x) {
+    Rng rngx = rngy.fork(x);
+    for (int s = s0; s < s1; ++s) {
+      rngs[n] = rngx.ForSample(s);
+      rays[n] = CameraRay(rngs[n], look_at, vec2{x, y});
+      xs[n] = x;
+      if (++n == RayPacket::kSize) flush();
+    }
+  }
+  if (n > 0) flush();
+}
+
+// Same as SampleSpanPackets(), but traces all of the span's samples together
+// with the Wavefront engine.
+void SampleSpanWavefront(Wavefront* wf, const Rng& rngy,
+                         const Lookat& look_at, int y, int x0, int x1, int s0,
+                         int s1, vec3d* sums) {
+  const int ns = s1 - s0;
+  std::vector<vec3> samples((x1 - x0) * ns, vec3{0, 0, 0});
+  for (int x = x0; x < x1; ++x) {
+    Rng rngx = rngy.fork(x);
+    for (int s = s0; s < s1; ++s) {
+      Rng rng = rngx.ForSample(s);
+      Ray ray = CameraRay(rng, look_at, vec2{x, y});
+      wf->Add(ray, rng, (x - x0) * ns + (s - s0));
+    }
+  }
+  wf->Run(samples.data());
+  for (int x = x0; x < x1; ++x) {
+    for (int s = 0; s < ns; ++s) sums[x] += samples[(x - x0) * ns + s];
+  }
+}
+
+// Adds samples [s0, s1) of pixels [x0, x1) of line y to sums[x0..x1). Returns
+// false if interrupted.
+bool SampleSpan(const MyScene& scene, Wavefront* wavefront, const Rng& rngy,
+                const Lookat& look_at, int y, int x0, int x1, int s0, int s1,
+                vec3d* sums) {
+  if (engine == Engine::kPacket) {
+    SampleSpanPackets(scene, rngy, look_at, y, x0, x1, s0, s1, sums);
+  } else if (engine == Engine::kWavefront) {
+    SampleSpanWavefront(wavefront, rngy, look_at, y, x0, x1, s0, s1, sums);
+  } else if (engine == Engine::kPath) {
+    for (int x = x0; x < x1; ++x) {
+      Rng rngx = rngy.fork(x);
+      for (int s = s0; s < s1; ++s) {
+        Rng rng = rngx.ForSample(s);
+        Ray ray = CameraRay(rng, look_at, vec2{x, y});
+        sums[x] += TracePath(scene, rng, ray, rr_depth);
+      }
+      if (!running.load(std::memory_order_relaxed)) return false;
+    }
+  } else {
+    for (int x = x0; x < x1; ++x) {
       // rngy.next();
-      Random rngx = rngy.fork(x);
-      vec3 color{0, 0, 0};
-      for (int s = 0; s < kSamples; ++s) {
+      Rng rngx = rngy.fork(x);
+      for (int s = s0; s < s1; ++s) {
         // rngx.next();
-        Random rng = rngx.fork(s);
-        color += RenderPixel(&scene, rng, look_at, vec2{x, y});
+        Rng rng = rngx.ForSample(s);
+        sums[x] += RenderPixel(&scene, rng, look_at, vec2{x, y});
       }
-      color /= kSamples;
-      ptr[0] = color.x;
-      ptr[1] = color.y;
-      ptr[2] = color.z;
-      ptr += 3;
-      if (view_data) {
-        vdptr[0] = Image::from_float(color.z);
-        vdptr[1] = Image::from_float(color.y);
-        vdptr[2] = Image::from_float(color.x);
-        vdptr += 4;
+      if (!running.load(std::memory_order_relaxed)) return false;
+    }
+  }
+  return running.load(std::memory_order_relaxed);
+}
+
+// Adds samples of pixel (x, y) to *sum one at a time, until the noise drops
+// below noise_threshold or there are max_samples. Returns the number of
+// samples, or zero if interrupted.
+int SampleAdaptive(const MyScene& scene, Wavefront* wavefront,
+                   const Rng& rngy, const Lookat& look_at, int y, int x,
+                   vec3d* sums) {
+  const vec3d kLuminance{.2126, .7152, .0722};
+  double sum = 0;
+  double sum_sq = 0;
+  int n = 0;
+  while (n < max_samples) {
+    const vec3d before = sums[x];
+    if (!SampleSpan(scene, wavefront, rngy, look_at, y, x, x + 1, n, n + 1,
+                    sums)) {
+      return 0;
+    }
+    const double lum = dot(sums[x] - before, kLuminance);
+    sum += lum;
+    sum_sq += lum * lum;
+    ++n;
+    // Only test at doubling sample counts, to limit early-stopping bias.
+    if (n < kSamples || (n & (n - 1)) != 0) continue;
+    const double mean = sum / n;
+    const double variance = fmax(0., (sum_sq - sum * mean) / (n - 1));
+    if (sqrt(variance / n) < noise_threshold * mean) break;
+  }
+  return n;
+}
+
+// Renders pixels [x0, x1) of line y, writing the average of the first s1
+// samples to out and view_data. Adds the number of samples taken to
+// *num_samples. Returns false if interrupted.
+bool RenderSpan(const MyScene& scene, Wavefront* wavefront, const Rng& rng,
+                const Lookat& look_at, int y, int x0, int x1, const Pass& pass,
+                Image* out, uint8_t* view_data, vec3d* scratch,
+                int64_t* num_samples) {
+  vec3d* sums = scratch;
+  if (pass.sums != nullptr) {
+    sums = pass.sums + y * kWidth;
+  } else {
+    std::fill(sums + x0, sums + x1, vec3d{0, 0, 0});
+  }
+  Rng rngy = rng.fork(y);
+  const bool adaptive = noise_threshold > 0 && pass.sums == nullptr;
+  std::vector<int> counts(adaptive ? x1 - x0 : 0);  // Samples per pixel.
+  if (adaptive) {
+    for (int x = x0; x < x1; ++x) {
+      counts[x - x0] =
+          SampleAdaptive(scene, wavefront, rngy, look_at, y, x, sums);
+      if (counts[x - x0] == 0) return false;
+      *num_samples += counts[x - x0];
+    }
+  } else {
+    if (!SampleSpan(scene, wavefront, rngy, look_at, y, x0, x1, pass.s0,
+                    pass.s1, sums)) {
+      return false;
+    }
+    *num_samples += (x1 - x0) * (pass.s1 - pass.s0);
+  }
+  std::vector<double> span((x1 - x0) * 3);
+  double* ptr = span.data();
+  for (int x = x0; x < x1; ++x) {
+    vec3d color = sums[x] / (adaptive ? counts[x - x0] : pass.s1);
+    ptr[0] = color.x;
+    ptr[1] = color.y;
+    ptr[2] = color.z;
+    ptr += 3;
+  }
+  out->SetRow(y, x0, x1, span.data());
+  if (view_data) {
+    encoder.RowBgra(span.data(), x1 - x0,
+                    view_data + (y * out->width_ + x0) * 4);
+  }
+  return true;
+}
+
+// What one thread did during a frame.
+struct ThreadStats {
+  double busy = 0;  // Seconds spent rendering.
+  int items = 0;    // Lines or tiles rendered.
+  int stolen = 0;   // Tiles taken from another thread's deque.
+  int64_t samples = 0;
+};
+
+// Renders scanlines from line, or tiles from tiles if it's not null. Tells
+// writer about every finished one, if it's not null.
+void RendererThread(int thread, std::atomic<int>* line, TileScheduler* tiles,
+                    const Pass& pass, const Lookat& look_at,
+                    const MyScene& scene, const Rng& rng, Image* out,
+                    uint8_t* view_data, DirtyRows* view_dirty,
+                    ImageWriter* writer, ThreadStats* stats) {
+  std::vector<vec3d> scratch(kWidth);
+  Wavefront wavefront(scene);
+  while (1) {
+    Tile t;
+    if (tiles != nullptr) {
+      bool stolen;
+      if (!tiles->Next(thread, &t, &stolen)) return;
+      if (stolen) stats->stolen++;
+    } else {
+      const int y = line->fetch_add(1, std::memory_order_acq_rel);
+      if (y >= kHeight) return;
+      t = Tile{0, y, kWidth, y + 1};
+    }
+    timespec t0 = Now();
+    for (int y = t.y0; y < t.y1; ++y) {
+      if (!RenderSpan(scene, &wavefront, rng, look_at, y, t.x0, t.x1, pass,
+                      out, view_data, scratch.data(), &stats->samples)) {
+        return;
       }
-      if (!running.load(std::memory_order_relaxed)) return;
+      if (view_dirty != nullptr) view_dirty->Mark(y, y + 1);
     }
+    stats->busy += Seconds(Now() - t0);
+    stats->items++;
+    if (writer != nullptr) writer->Done(t.x0, t.y0, t.x1, t.y1);
   }
 }
 
-Image Render() {
-  Image out(kWidth, kHeight);
+// Zeroes the framebuffers in slices, one slice per worker. Linux puts a page
+// on the NUMA node of the thread that first touches it, so with pinned workers
+// the frame gets spread over the nodes they run on, instead of all of it
+// landing on the main thread's node. In the tiled layout, the slices line up
+// with the runs of tiles that TileScheduler deals to each thread.
+void FirstTouch(ThreadPool* pool, Image* out, uint8_t* view_data) {
+  const int n = pool->size();
+  pool->Run([n, out, view_data](int t) {
+    const int y0 = kHeight * t / n;
+    const int y1 = kHeight * (t + 1) / n;
+    out->Zero(t, n);
+    if (view_data) {
+      memset(view_data + y0 * kWidth * 4, 0, (y1 - y0) * kWidth * 4);
+    }
+  });
+}
+
+Image Render(ThreadPool* pool) {
+  Image out(kWidth, kHeight, image_format,
+            tile_size > 0 ? Image::Layout::kTiles : Image::Layout::kRows,
+            tile_size);
   const Lookat look_at(kCamera, kLookAt);
   const MyScene scene;
-  const Random rng;
+  const Rng rng(sampler, kSamples);
   std::unique_ptr<uint8_t[]> view_data;
+  std::unique_ptr<DirtyRows> view_dirty;
   std::unique_ptr<std::thread> view_thread;
 
   if (want_display) {
     view_data.reset(new uint8_t[kHeight * kWidth * 4]);
-    view_thread.reset(new std::thread([&view_data]() {
-      GLViewer::Open(kWidth, kHeight, view_data.get());
+    view_dirty.reset(new DirtyRows(kHeight));
+  }
+  if (numa_first_touch) FirstTouch(pool, &out, view_data.get());
+  if (want_display) {
+    view_thread.reset(new std::thread([&view_data, &view_dirty]() {
+      GLViewer::Open(kWidth, kHeight, view_data.get(), view_dirty.get());
       while (GLViewer::IsRunning() && running) {
         GLViewer::Poll();
         GLViewer::Update();
@@ -181,24 +520,66 @@ Image Render() {
     }));
   }
 
+  std::vector<vec3d> sums;
+  if (progressive) sums.resize(kWidth * kHeight);
   for (int r = 0; r < runs; ++r) {
-    std::atomic<int> line = 0;
+    std::vector<ThreadStats> stats(num_threads);
+    // The last run's pixels are final as soon as they're rendered, so the
+    // output file gets written while the rest of the frame renders.
+    // Progressive passes keep changing them, main() writes those.
+    std::unique_ptr<ImageWriter> writer;
+    if (opt_outfile != nullptr && !progressive && r == runs - 1) {
+      writer = OpenImageWriter(opt_outfile, out, png_level, tone_map);
+    }
+    // Renders one pass over the frame.
+    auto run_pass = [&](const Pass& pass) {
+      std::atomic<int> line = 0;
+      std::unique_ptr<TileScheduler> tiles;
+      if (tile_size > 0) {
+        tiles.reset(new TileScheduler(kWidth, kHeight, tile_size, num_threads));
+      }
+      pool->Run([&line, &tiles, &pass, &look_at, &scene, &rng, &out,
+                 &view_data, &view_dirty, &writer, &stats](int t) {
+        RendererThread(t, &line, tiles.get(), pass, look_at, scene, rng, &out,
+                       view_data.get(), view_dirty.get(), writer.get(),
+                       &stats[t]);
+      });
+    };
     timespec t0 = Now();
-    {
-      // Fork-join.
-      std::vector<std::thread> thr;
-      thr.reserve(num_threads);
-      for (int t = 0; t < num_threads; ++t) {
-        thr.emplace_back([&line, &look_at, &scene, &rng, &out, &view_data]() {
-          RendererThread(&line, look_at, scene, rng, &out, view_data.get());
-        });
+    int samples = kSamples;
+    if (progressive) {
+      // One sample per pixel per pass, until out of samples or time.
+      std::fill(sums.begin(), sums.end(), vec3d{0, 0, 0});
+      for (samples = 0; samples < kSamples;) {
+        run_pass(Pass{samples, samples + 1, sums.data()});
+        if (!running) break;  // The pass was cut short.
+        ++samples;
+        if (time_budget > 0 && Seconds(Now() - t0) >= time_budget) break;
       }
+    } else {
+      run_pass(Pass{0, kSamples, nullptr});
+    }
+    timespec t1 = Now();
+    std::cout << t1 - t0 << " sec";
+    if (progressive) std::cout << ", " << samples << " samples per pixel";
+    if (noise_threshold > 0 && !progressive) {
+      int64_t total = 0;
+      for (const auto& st : stats) total += st.samples;
+      std::cout << ", " << double(total) / (kWidth * kHeight)
+                << " samples per pixel";
+    }
+    std::cout << std::endl;  // Flush.
+    if (print_thread_stats) {
+      const double wall = Seconds(t1 - t0);
       for (int t = 0; t < num_threads; ++t) {
-        thr[t].join();
+        std::cout << "thread " << t << ": busy " << stats[t].busy
+                  << " sec, idle " << wall - stats[t].busy << " sec, "
+                  << stats[t].items << (tile_size > 0 ? " tiles" : " lines");
+        if (tile_size > 0) std::cout << " (" << stats[t].stolen << " stolen)";
+        std::cout << "\n";
       }
     }
-    timespec t1 = Now();
-    std::cout << t1 - t0 << " sec" << std::endl;  // Flush.
+    if (writer != nullptr) writer->Finish(pool);
   }
 
   if (view_thread != nullptr) view_thread->join();
@@ -210,8 +591,9 @@ Image Render() {
 int main(int argc, char** argv) {
   ProcessOpts(argc, argv);
   signal(SIGINT, sigint_handler);
-  Image img = Render();
-  if (opt_outfile != nullptr) {
-    Writepng(img, opt_outfile);
+  ThreadPool pool(num_threads, pin_threads);
+  Image img = Render(&pool);
+  if (opt_outfile != nullptr && progressive) {
+    WriteImage(img, opt_outfile, png_level, tone_map, &pool);
   }
 }
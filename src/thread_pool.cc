@@ -0,0 +1,73 @@
+#include "thread_pool.h"
+
+#include <err.h>
+#include <pthread.h>
+#include <sched.h>
+
+ThreadPool::ThreadPool(int num_threads, bool pin) {
+  threads_.reserve(num_threads);
+  for (int t = 0; t < num_threads; ++t) {
+    threads_.emplace_back([this, t]() { Worker(t); });
+    if (pin) Pin(&threads_.back(), t);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    quit_ = true;
+  }
+  start_.notify_all();
+  for (auto& t : threads_) t.join();
+}
+
+void ThreadPool::Run(const std::function<void(int)>& job) {
+  std::unique_lock<std::mutex> lock(mu_);
+  job_ = &job;
+  pending_ = threads_.size();
+  generation_++;
+  start_.notify_all();
+  done_.wait(lock, [this]() { return pending_ == 0; });
+  job_ = nullptr;
+}
+
+void ThreadPool::Worker(int thread) {
+  uint64_t seen = 0;
+  while (1) {
+    const std::function<void(int)>* job;
+    {
+      std::unique_lock<std::mutex> lock(mu_);
+      start_.wait(lock,
+                  [this, seen]() { return quit_ || generation_ != seen; });
+      if (quit_) return;
+      seen = generation_;
+      job = job_;
+    }
+    (*job)(thread);
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      if (--pending_ > 0) continue;
+    }
+    done_.notify_one();
+  }
+}
+
+// static
+void ThreadPool::Pin(std::thread* t, int thread) {
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+    err(1, "sched_getaffinity() failed");
+  }
+  const int num_cpus = CPU_COUNT(&allowed);
+  // Find the (thread % num_cpus)-th allowed CPU.
+  int want = thread % num_cpus;
+  int cpu = 0;
+  for (; cpu < CPU_SETSIZE; ++cpu) {
+    if (CPU_ISSET(cpu, &allowed) && want-- == 0) break;
+  }
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  int ret = pthread_setaffinity_np(t->native_handle(), sizeof(set), &set);
+  if (ret != 0) errx(1, "pthread_setaffinity_np(%d) failed: %d", cpu, ret);
+}
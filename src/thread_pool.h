@@ -0,0 +1,38 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads that live as long as the pool. Run() hands
+// every worker the same job and waits for all of them to finish it, so it
+// looks like a fork-join without creating any threads.
+class ThreadPool {
+ public:
+  // With pin set, worker i is pinned to the i-th CPU the process may run on
+  // (wrapping around if there are more workers than CPUs).
+  ThreadPool(int num_threads, bool pin);
+  ~ThreadPool();
+
+  int size() const { return threads_.size(); }
+
+  // Calls job(i) on worker i, for every worker. Returns when they're done.
+  // Must not be called concurrently, or from a worker.
+  void Run(const std::function<void(int)>& job);
+
+ private:
+  void Worker(int thread);
+  static void Pin(std::thread* t, int thread);
+
+  std::mutex mu_;
+  std::condition_variable start_;  // A new job, or quitting.
+  std::condition_variable done_;   // pending_ reached zero.
+  const std::function<void(int)>* job_ = nullptr;
+  uint64_t generation_ = 0;  // Incremented for each job.
+  int pending_ = 0;          // Workers still running the current job.
+  bool quit_ = false;
+  std::vector<std::thread> threads_;
+};
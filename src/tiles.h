@@ -0,0 +1,95 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// Pixels [x0, x1) x [y0, y1).
+struct Tile {
+  int x0, y0, x1, y1;
+};
+
+namespace {
+
+// Puts a zero bit between each of the bits of v.
+inline uint64_t Spread(uint32_t v) {
+  uint64_t x = v;
+  x = (x | (x << 16)) & 0x0000FFFF0000FFFFULL;
+  x = (x | (x << 8)) & 0x00FF00FF00FF00FFULL;
+  x = (x | (x << 4)) & 0x0F0F0F0F0F0F0F0FULL;
+  x = (x | (x << 2)) & 0x3333333333333333ULL;
+  x = (x | (x << 1)) & 0x5555555555555555ULL;
+  return x;
+}
+
+// Interleaves the bits of x and y.
+inline uint64_t Morton(uint32_t x, uint32_t y) {
+  return Spread(x) | (Spread(y) << 1);
+}
+
+}  // namespace
+
+// Hands out the tiles of a frame to worker threads. Tiles are put in Morton
+// (Z-curve) order and dealt out in contiguous runs, one run per thread, so each
+// thread starts on a compact part of the image. A thread takes tiles from the
+// front of its own deque, and when that runs out, steals from the back of
+// another thread's deque: the tiles furthest from where its owner is working.
+class TileScheduler {
+ public:
+  TileScheduler(int width, int height, int tile_size, int num_threads)
+      : num_queues_(num_threads), queues_(new Queue[num_threads]) {
+    std::vector<std::pair<uint64_t, Tile>> order;
+    for (int y = 0; y < height; y += tile_size) {
+      for (int x = 0; x < width; x += tile_size) {
+        Tile t{x, y, std::min(x + tile_size, width),
+               std::min(y + tile_size, height)};
+        order.emplace_back(Morton(x / tile_size, y / tile_size), t);
+      }
+    }
+    std::sort(order.begin(), order.end(),
+              [](const auto& a, const auto& b) { return a.first < b.first; });
+    for (size_t i = 0; i < order.size(); ++i) {
+      queues_[i * num_threads / order.size()].tiles.push_back(order[i].second);
+    }
+  }
+
+  // Returns false when there are no tiles left anywhere. Sets *stolen if the
+  // tile came from another thread's deque.
+  bool Next(int thread, Tile* tile, bool* stolen) {
+    {
+      Queue& q = queues_[thread];
+      std::lock_guard<std::mutex> lock(q.mu);
+      if (!q.tiles.empty()) {
+        *tile = q.tiles.front();
+        q.tiles.pop_front();
+        *stolen = false;
+        return true;
+      }
+    }
+    for (int i = 1; i < num_queues_; ++i) {
+      Queue& q = queues_[(thread + i) % num_queues_];
+      std::lock_guard<std::mutex> lock(q.mu);
+      if (!q.tiles.empty()) {
+        *tile = q.tiles.back();
+        q.tiles.pop_back();
+        *stolen = true;
+        return true;
+      }
+    }
+    return false;
+  }
+
+ private:
+  // Own cache line, so that threads locking different queues don't contend.
+  struct alignas(64) Queue {
+    std::mutex mu;
+    std::deque<Tile> tiles;
+  };
+
+  const int num_queues_;
+  std::unique_ptr<Queue[]> queues_;
+};
@@ -24,6 +24,8 @@ timespec operator-(const timespec& a, const timespec& b) {
   return out;
 }
 
+inline double Seconds(const timespec& t) { return t.tv_sec + t.tv_nsec * 1e-9; }
+
 std::ostream& operator<<(std::ostream& os, const timespec& t) {
   return os << t.tv_sec << '.' << std::setfill('0') << std::setw(9)
             << t.tv_nsec;
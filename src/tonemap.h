@@ -0,0 +1,150 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+
+#include "image.h"
+
+// How linear radiance gets squeezed into [0, 1] before gamma encoding.
+enum class ToneMap : uint8_t {
+  kClamp,     // Anything brighter than 1 is white.
+  kReinhard,  // x / (1 + x), never quite white.
+  kAces,      // Narkowicz 2015, "ACES Filmic Tone Mapping Curve".
+};
+
+// Tone maps linear values and gamma encodes them to 8 bits. With kClamp, the
+// output is exactly Image::from_float()'s, without a powf() per value.
+//
+// The gamma curve is a table indexed by the exponent and top 8 mantissa bits
+// of the float, 256 entries per octave from 2^-20 (which encodes to zero) up
+// to 1. Each entry holds the code at the start of its range, and how far into
+// the range the next code starts, if it does: ranges are narrow enough to
+// hold at most one step. So a lookup is one load and a compare, and a row of
+// them vectorizes into gathers.
+class Encoder {
+ public:
+  explicit Encoder(ToneMap op = ToneMap::kClamp) : op_(op) {
+    // thresholds[k] is the smallest float that Image::from_float() turns into
+    // k or more. Non-negative floats sort the same as their bits.
+    // Codes past 255 never start.
+    std::array<uint32_t, 258> thresholds;
+    thresholds[0] = 0;
+    thresholds[256] = thresholds[257] = UINT32_MAX;
+    for (int k = 1; k < 256; ++k) {
+      uint32_t lo = 0;
+      uint32_t hi = kOneBits;
+      while (lo < hi) {
+        const uint32_t mid = lo + (hi - lo) / 2;
+        if (Image::from_float(FromBits(mid)) >= k) {
+          hi = mid;
+        } else {
+          lo = mid + 1;
+        }
+      }
+      thresholds[k] = lo;
+    }
+    for (int i = 0; i < kTableSize; ++i) {
+      const uint32_t start = kMinBits + (uint32_t(i) << kRangeShift);
+      const int code = Image::from_float(FromBits(start));
+      // A range the next code starts past gets kRangeSize, which no offset
+      // reaches.
+      const uint32_t next = std::min<uint64_t>(
+          uint64_t(thresholds[code + 1]) - start, kRangeSize);
+      assert(uint64_t(thresholds[code + 2]) - start >= kRangeSize);
+      table_[i] = code | (next << 8);
+    }
+    assert((table_[0] & 255) == 0);  // Everything below 2^-20 is black.
+  }
+
+  uint8_t operator()(float linear) const {
+    switch (op_) {
+      case ToneMap::kClamp:
+        return Lookup(Map<ToneMap::kClamp>(linear));
+      case ToneMap::kReinhard:
+        return Lookup(Map<ToneMap::kReinhard>(linear));
+      case ToneMap::kAces:
+        return Lookup(Map<ToneMap::kAces>(linear));
+    }
+    return 0;
+  }
+
+  // Encodes n values from src into dst.
+  void Row(const double* src, int n, uint8_t* dst) const {
+    switch (op_) {
+      case ToneMap::kClamp:
+        return RowT<ToneMap::kClamp>(src, n, dst);
+      case ToneMap::kReinhard:
+        return RowT<ToneMap::kReinhard>(src, n, dst);
+      case ToneMap::kAces:
+        return RowT<ToneMap::kAces>(src, n, dst);
+    }
+  }
+
+  // Encodes n RGB pixels from src into BGRA pixels in dst, for the viewers.
+  // Leaves alpha alone.
+  void RowBgra(const double* src, int n, uint8_t* dst) const {
+    switch (op_) {
+      case ToneMap::kClamp:
+        return RowBgraT<ToneMap::kClamp>(src, n, dst);
+      case ToneMap::kReinhard:
+        return RowBgraT<ToneMap::kReinhard>(src, n, dst);
+      case ToneMap::kAces:
+        return RowBgraT<ToneMap::kAces>(src, n, dst);
+    }
+  }
+
+ private:
+  static constexpr int kOctaves = 20;
+  static constexpr int kRangeShift = 23 - 8;  // Keeps 8 mantissa bits.
+  static constexpr uint32_t kRangeSize = 1u << kRangeShift;
+  static constexpr uint32_t kOneBits = 127u << 23;  // 1.0f
+  static constexpr uint32_t kMinBits = (127u - kOctaves) << 23;
+  // One more, for 1 itself.
+  static constexpr int kTableSize = (kOctaves << 8) + 1;
+
+  static float FromBits(uint32_t bits) {
+    float f;
+    memcpy(&f, &bits, 4);
+    return f;
+  }
+
+  template <ToneMap op>
+  static float Map(float x) {
+    x = std::max(x, 0.f);
+    if (op == ToneMap::kReinhard) return x / (1 + x);
+    if (op == ToneMap::kAces) {
+      return (x * (2.51f * x + .03f)) / (x * (2.43f * x + .59f) + .14f);
+    }
+    return x;
+  }
+
+  // Encodes a tone mapped value.
+  uint8_t Lookup(float t) const {
+    t = std::min(std::max(t, FromBits(kMinBits)), 1.f);
+    uint32_t bits;
+    memcpy(&bits, &t, 4);
+    bits -= kMinBits;
+    const uint32_t entry = table_[bits >> kRangeShift];
+    return (entry & 255) + ((bits & (kRangeSize - 1)) >= (entry >> 8));
+  }
+
+  template <ToneMap op>
+  void RowT(const double* src, int n, uint8_t* dst) const {
+    for (int i = 0; i < n; ++i) dst[i] = Lookup(Map<op>(src[i]));
+  }
+
+  template <ToneMap op>
+  void RowBgraT(const double* src, int n, uint8_t* dst) const {
+    for (int i = 0; i < n; ++i) {
+      dst[i * 4 + 0] = Lookup(Map<op>(src[i * 3 + 2]));
+      dst[i * 4 + 1] = Lookup(Map<op>(src[i * 3 + 1]));
+      dst[i * 4 + 2] = Lookup(Map<op>(src[i * 3 + 0]));
+    }
+  }
+
+  ToneMap op_;
+  std::array<uint32_t, kTableSize> table_;
+};
@@ -0,0 +1,52 @@
+// Benchmarks of turning linear radiance into 8-bit pixels.
+#include <benchmark/benchmark.h>
+
+#include <cstdint>
+#include <vector>
+
+#include "image.h"
+#include "random.h"
+#include "tonemap.h"
+
+namespace {
+
+// A row of a render: mostly in [0, 1], some of it brighter.
+constexpr int kRowValues = 1920 * 3;
+std::vector<double> TestRow() {
+  std::vector<double> row(kRowValues);
+  Random rng;
+  for (double& v : row) v = 1.2 * rng.rand() * rng.rand();
+  return row;
+}
+
+// What the writers and the preview used to do.
+void BM_FromFloat(benchmark::State& state) {
+  const std::vector<double> row = TestRow();
+  std::vector<uint8_t> out(kRowValues);
+  for (auto _ : state) {
+    for (int i = 0; i < kRowValues; ++i) out[i] = Image::from_float(row[i]);
+    benchmark::ClobberMemory();
+  }
+  state.SetItemsProcessed(state.iterations() * kRowValues);
+}
+BENCHMARK(BM_FromFloat);
+
+// Arg is the ToneMap.
+void BM_Encoder(benchmark::State& state) {
+  const std::vector<double> row = TestRow();
+  std::vector<uint8_t> out(kRowValues);
+  const Encoder encoder(static_cast<ToneMap>(state.range(0)));
+  for (auto _ : state) {
+    encoder.Row(row.data(), kRowValues, out.data());
+    benchmark::ClobberMemory();
+  }
+  state.SetItemsProcessed(state.iterations() * kRowValues);
+}
+BENCHMARK(BM_Encoder)
+    ->Arg(int(ToneMap::kClamp))
+    ->Arg(int(ToneMap::kReinhard))
+    ->Arg(int(ToneMap::kAces));
+
+}  // namespace
+
+BENCHMARK_MAIN();
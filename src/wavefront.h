@@ -0,0 +1,135 @@
+#pragma once
+
+#include <utility>
+#include <vector>
+
+#include "random.h"
+#include "ray.h"
+
+// Breadth-first path tracing. Instead of recursing through Scene::Trace(),
+// keeps a whole batch of rays in flight in structure-of-arrays queues, and
+// runs intersection and shading as separate passes over the batch, one bounce
+// level at a time. Rays that don't spawn new rays are compacted away between
+// levels.
+//
+// Given the same rngs, produces the same colors as Scene::Trace(), up to
+// rounding: the weights along a path are multiplied in a different order.
+class Wavefront {
+ public:
+  explicit Wavefront(const Scene& scene) : scene_(scene) {}
+
+  // Queues a camera ray. Run() adds its color to out[slot].
+  void Add(const Ray& r, const Rng& rng, int slot) {
+    cur_.Push(r, vec3{1, 1, 1}, /*pdf=*/0, rng, slot);
+  }
+
+  // Traces everything that was queued, leaves the queues empty.
+  void Run(vec3* out) {
+    for (int level = 0; cur_.size() > 0; ++level) {
+      Intersect();
+      Shade(level, out);
+      std::swap(cur_, next_);
+      next_.clear();
+    }
+  }
+
+ private:
+  struct Queue {
+    int size() const { return slot.size(); }
+
+    void clear() {
+      sx.clear();
+      sy.clear();
+      sz.clear();
+      dx.clear();
+      dy.clear();
+      dz.clear();
+      wx.clear();
+      wy.clear();
+      wz.clear();
+      pdf.clear();
+      rng.clear();
+      slot.clear();
+    }
+
+    void Push(const Ray& r, const vec3& w, Real p, const Rng& g,
+              int s) {
+      sx.push_back(r.start.x);
+      sy.push_back(r.start.y);
+      sz.push_back(r.start.z);
+      dx.push_back(r.dir.x);
+      dy.push_back(r.dir.y);
+      dz.push_back(r.dir.z);
+      wx.push_back(w.x);
+      wy.push_back(w.y);
+      wz.push_back(w.z);
+      pdf.push_back(p);
+      rng.push_back(g);
+      slot.push_back(s);
+    }
+
+    Ray ray(int i) const {
+      return Ray{{sx[i], sy[i], sz[i]}, {dx[i], dy[i], dz[i]}};
+    }
+    vec3 weight(int i) const { return vec3{wx[i], wy[i], wz[i]}; }
+
+    std::vector<Real> sx, sy, sz;  // Ray start.
+    std::vector<Real> dx, dy, dz;  // Ray direction.
+    std::vector<Real> wx, wy, wz;  // Product of weights along the path.
+    std::vector<Real> pdf;         // See Bounce.
+    std::vector<Rng> rng;
+    std::vector<int> slot;  // Where the path's color goes.
+  };
+
+  // Fills hits_ for everything in cur_, a packet at a time.
+  void Intersect() {
+    hits_.resize(cur_.size());
+    for (int begin = 0; begin < cur_.size(); begin += RayPacket::kSize) {
+      Ray rays[RayPacket::kSize];
+      int n = 0;
+      for (int i = begin; i < cur_.size() && n < RayPacket::kSize; ++i) {
+        rays[n++] = cur_.ray(i);
+      }
+      scene_.IntersectPacket(RayPacket(rays, n), &hits_[begin]);
+    }
+  }
+
+  // Adds light that was hit to out, and queues the next level's rays in next_.
+  // Shadow rays are tested right away.
+  void Shade(int level, vec3* out) {
+    const bool last = level + 1 > scene_.max_level();
+    const Lights& lights = scene_.lights();
+    for (int i = 0; i < cur_.size(); ++i) {
+      const Scene::Hit& h = hits_[i];
+      if (h.elem == nullptr) continue;
+      const Shader& shader = h.elem->shader;
+      if (shader.light) {
+        out[cur_.slot[i]] +=
+            cur_.weight(i) * shader.color *
+            Shader::LightWeight(lights, h.elem->obj, cur_.ray(i), h.dist,
+                                cur_.pdf[i]);
+        continue;
+      }
+      if (last) continue;
+      Bounce bounces[Shader::kMaxBounces];
+      const int n = shader.Scatter(cur_.rng[i], h.elem->obj, cur_.ray(i),
+                                   h.dist, lights, bounces);
+      for (int j = 0; j < n; ++j) {
+        const Bounce& b = bounces[j];
+        if (b.shadow) {
+          if (!scene_.Occluded(b.ray, Shader::kShadowEnd)) {
+            out[cur_.slot[i]] += cur_.weight(i) * b.weight;
+          }
+          continue;
+        }
+        next_.Push(b.ray, cur_.weight(i) * b.weight, b.pdf, b.rng,
+                   cur_.slot[i]);
+      }
+    }
+  }
+
+  const Scene& scene_;
+  Queue cur_;   // Rays at the current level.
+  Queue next_;  // Rays for the next level.
+  std::vector<Scene::Hit> hits_;
+};
@@ -0,0 +1,190 @@
+// Write out linear float images.
+//
+// References:
+//   http://www.pauldebevec.com/Research/HDR/PFM/
+//   https://openexr.com/en/latest/OpenEXRFileLayout.html
+
+#include "writehdr.h"
+
+#include <err.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "image.h"
+#include "thread_pool.h"
+
+// Both formats are little-endian here, and the floats get copied as they are.
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__,
+              "HdrWriter assumes a little-endian host");
+
+namespace {
+
+void add32(std::string* s, uint32_t x) {
+  s->append(reinterpret_cast<const char*>(&x), 4);
+}
+
+void add_float(std::string* s, float f) {
+  s->append(reinterpret_cast<const char*>(&f), 4);
+}
+
+// An EXR header attribute: name, type, size of the value, then the value.
+void add_attribute(std::string* s, const char* name, const char* type,
+                   const std::string& value) {
+  s->append(name, strlen(name) + 1);
+  s->append(type, strlen(type) + 1);
+  add32(s, value.length());
+  s->append(value);
+}
+
+std::string exr_header(int width, int height) {
+  std::string s;
+  add32(&s, 20000630);  // Magic number.
+  add32(&s, 2);         // Version 2, single part scanline file.
+
+  // Channels are listed, and stored, in alphabetical order.
+  std::string channels;
+  for (const char* name : {"B", "G", "R"}) {
+    channels.append(name, 2);
+    add32(&channels, 2);       // Pixel type FLOAT.
+    channels.append(4, '\0');  // pLinear, then three reserved bytes.
+    add32(&channels, 1);       // xSampling.
+    add32(&channels, 1);       // ySampling.
+  }
+  channels.push_back(0);
+  add_attribute(&s, "channels", "chlist", channels);
+  add_attribute(&s, "compression", "compression", std::string(1, 0));  // None.
+  std::string window;
+  add32(&window, 0);           // xMin.
+  add32(&window, 0);           // yMin.
+  add32(&window, width - 1);   // xMax.
+  add32(&window, height - 1);  // yMax.
+  add_attribute(&s, "dataWindow", "box2i", window);
+  add_attribute(&s, "displayWindow", "box2i", window);
+  add_attribute(&s, "lineOrder", "lineOrder", std::string(1, 0));  // Top down.
+  std::string one;
+  add_float(&one, 1);
+  add_attribute(&s, "pixelAspectRatio", "float", one);
+  std::string center;
+  add_float(&center, 0);
+  add_float(&center, 0);
+  add_attribute(&s, "screenWindowCenter", "v2f", center);
+  add_attribute(&s, "screenWindowWidth", "float", one);
+  s.push_back(0);  // End of header.
+  return s;
+}
+
+}  // namespace
+
+HdrWriter::HdrWriter(const char* filename, const Image& img, Format format)
+    : img_(img), format_(format), done_(0) {
+  const int w = img.width_;
+  const int h = img.height_;
+  std::string header;
+  if (format == kPfm) {
+    // A negative scale means little-endian.
+    header = "PF\n" + std::to_string(w) + " " + std::to_string(h) + "\n-1.0\n";
+    data_offset_ = header.length();
+    row_bytes_ = size_t(w) * 12;
+  } else {
+    header = exr_header(w, h);
+    // After the header, a table of where each scanline starts. Uncompressed,
+    // a chunk is one scanline: its y, the size of its pixels, then the
+    // pixels, one channel after another. The first chunk's y and size come
+    // before the first row of pixels.
+    data_offset_ = header.length() + size_t(h) * 8 + 8;
+    row_bytes_ = 8 + size_t(w) * 12;
+  }
+  // Nothing follows the last row's pixels.
+  size_ = data_offset_ + row_bytes_ * (h - 1) + size_t(w) * 12;
+
+  fd_ = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
+  if (fd_ < 0) {
+    err(1, "open(\"%s\") failed", filename);
+  }
+  if (ftruncate(fd_, size_) != 0) {
+    err(1, "ftruncate(\"%s\") failed", filename);
+  }
+  void* map = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+  if (map == MAP_FAILED) {
+    err(1, "mmap(\"%s\") failed", filename);
+  }
+  map_ = static_cast<uint8_t*>(map);
+  // Rows get written in no particular order.
+  madvise(map_, size_, MADV_RANDOM);
+
+  memcpy(map_, header.data(), header.length());
+  if (format == kExr) {
+    uint8_t* table = map_ + header.length();
+    for (int y = 0; y < h; ++y) {
+      // The chunk's y and size come just before its pixels.
+      const uint64_t offset = data_offset_ - 8 + row_bytes_ * y;
+      const int32_t chunk[2] = {y, int32_t(w * 12)};
+      memcpy(table + y * 8, &offset, 8);
+      memcpy(map_ + offset, chunk, 8);
+    }
+  }
+}
+
+HdrWriter::~HdrWriter() {
+  if (fd_ >= 0) Finish();
+}
+
+uint8_t* HdrWriter::Pixel(int x, int y, int c) const {
+  size_t offset;
+  if (format_ == kPfm) {
+    offset = data_offset_ + row_bytes_ * (img_.height_ - 1 - y) + x * 12 +
+             c * 4;
+  } else {
+    // Channels are stored B, G, R.
+    offset = data_offset_ + row_bytes_ * y + (2 - c) * img_.width_ * 4 + x * 4;
+  }
+  return map_ + offset;
+}
+
+void HdrWriter::Convert(int x0, int y0, int x1, int y1) {
+  std::vector<double> scratch((x1 - x0) * 3);
+  for (int y = y0; y < y1; ++y) {
+    const double* src = img_.Row(y, x0, x1, scratch.data());
+    for (int c = 0; c < 3; ++c) {
+      for (int x = x0; x < x1; ++x) {
+        const float f = src[(x - x0) * 3 + c];
+        memcpy(Pixel(x, y, c), &f, 4);
+      }
+    }
+  }
+}
+
+void HdrWriter::Done(int x0, int y0, int x1, int y1) {
+  Convert(x0, y0, x1, y1);
+  done_.fetch_add(int64_t(x1 - x0) * (y1 - y0), std::memory_order_relaxed);
+}
+
+void HdrWriter::Finish(ThreadPool* pool) {
+  const int w = img_.width_;
+  const int h = img_.height_;
+  // If rendering was interrupted, some pixels were never reported. Convert
+  // the lot, it's cheap next to rendering.
+  if (done_.load() != int64_t(w) * h) {
+    if (pool != nullptr) {
+      const int n = pool->size();
+      pool->Run([this, n, w, h](int t) {
+        Convert(0, h * t / n, w, h * (t + 1) / n);
+      });
+    } else {
+      Convert(0, 0, w, h);
+    }
+  }
+  if (munmap(map_, size_) != 0) {
+    err(1, "munmap() failed");
+  }
+  if (close(fd_) != 0) {
+    err(1, "close() failed");
+  }
+  map_ = nullptr;
+  fd_ = -1;
+}
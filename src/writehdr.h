@@ -0,0 +1,41 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "imagewriter.h"
+
+// Writes the linear radiance of an image as 32-bit floats, with no tone
+// mapping or gamma, in one of:
+//
+//   kPfm: Portable Float Map, RGB ("PF"), little-endian, rows bottom to top.
+//   kExr: OpenEXR, scanlines of uncompressed FLOAT B, G and R channels.
+//
+// The file is sized up front and mapped into memory, and Done() converts the
+// pixels straight into the mapping. There's no staging buffer and no write()
+// copy: the kernel writes the dirty pages back.
+class HdrWriter : public ImageWriter {
+ public:
+  enum Format { kPfm, kExr };
+
+  HdrWriter(const char* filename, const Image& img, Format format);
+  ~HdrWriter() override;
+
+  void Done(int x0, int y0, int x1, int y1) override;
+  void Finish(ThreadPool* pool = nullptr) override;
+
+ private:
+  // Returns where channel c of pixel (x, y) goes in the mapping.
+  uint8_t* Pixel(int x, int y, int c) const;
+  void Convert(int x0, int y0, int x1, int y1);
+
+  const Image& img_;
+  const Format format_;
+  int fd_;
+  uint8_t* map_ = nullptr;
+  size_t size_ = 0;
+  size_t data_offset_ = 0;     // Of the first row of pixels.
+  size_t row_bytes_ = 0;       // From one row of pixels to the next.
+  std::atomic<int64_t> done_;  // Pixels converted by Done().
+};
@@ -1,8 +1,5 @@
 // Copyright (c) 2014 Emil Mikulic <emikulic@gmail.com>
-// Write out a 24-bit uncompressed PNG file.
-//
-// Please run the output through a PNG optimizer before storing or
-// transmitting it!
+// Write out a 24-bit PNG file.
 //
 // References:
 //   http://en.wikipedia.org/wiki/Portable_Network_Graphics
@@ -12,188 +9,306 @@
 
 #include <arpa/inet.h>  // htonl()
 #include <err.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <climits>
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <memory>
-#include <sstream>
+#include <mutex>
 #include <string>
+#include <vector>
 
+#include "deflate.h"
 #include "image.h"
+#include "thread_pool.h"
 
 namespace {
 
-constexpr uint16_t kUInt16Max = 0xFFFF;
-
 // This implements a CRC-32 (not CRC-32C)
 // Polynomial = 11101101101110001000001100100000b
 // Little-endian: 0xED B8 83 20 (CRC-32 / ANSI X3.66, ITU-T V.42)
 // Bit-reversed:  0x04 C1 1D B7
 // Intel's CRC32 opcode uses 0x11 ED C6 F4 1 (CRC-32C)
 //
-// {{{ Start of code taken from www.w3.org/TR/PNG/#D-CRCAppendix
-// Table of CRCs of all 8-bit messages.
-uint32_t crc_table[256];
-
-int crc_table_computed = 0;
-
-// Make the table for a fast CRC.
-void make_crc_table(void) {
-  unsigned long c;
-  int n, k;
-
-  for (n = 0; n < 256; n++) {
-    c = (unsigned long)(n);
-    for (k = 0; k < 8; k++) {
-      if (c & 1)
-        c = 0xedb88320L ^ (c >> 1);
-      else
-        c = c >> 1;
+// Slicing-by-8: table k holds the CRCs of every byte followed by k zero
+// bytes, so eight bytes can be looked up at once instead of one after
+// another. Table 0 is the one from www.w3.org/TR/PNG/#D-CRCAppendix.
+struct CrcTables {
+  constexpr CrcTables() : t() {
+    for (uint32_t n = 0; n < 256; ++n) {
+      uint32_t c = n;
+      for (int k = 0; k < 8; ++k) c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+      t[0][n] = c;
+    }
+    for (int k = 1; k < 8; ++k) {
+      for (int n = 0; n < 256; ++n) {
+        t[k][n] = t[0][t[k - 1][n] & 0xff] ^ (t[k - 1][n] >> 8);
+      }
     }
-    crc_table[n] = c;
   }
-  crc_table_computed = 1;
-}
+  uint32_t t[8][256];
+};
+constexpr CrcTables kCrc;
 
-static uint32_t update_crc(uint32_t crc, const uint8_t* buf, int len) {
+// Little endian only, like the rest of the writer.
+uint32_t update_crc(uint32_t crc, const uint8_t* buf, size_t len) {
   uint32_t c = crc;
-  if (!crc_table_computed) {
-    make_crc_table();
-  }
-  for (int n = 0; n < len; ++n) {
-    c = crc_table[(c ^ buf[n]) & 0xff] ^ (c >> 8);
+  for (; len >= 8; len -= 8, buf += 8) {
+    uint32_t lo, hi;
+    memcpy(&lo, buf, 4);
+    memcpy(&hi, buf + 4, 4);
+    lo ^= c;
+    c = kCrc.t[7][lo & 0xff] ^ kCrc.t[6][(lo >> 8) & 0xff] ^
+        kCrc.t[5][(lo >> 16) & 0xff] ^ kCrc.t[4][lo >> 24] ^
+        kCrc.t[3][hi & 0xff] ^ kCrc.t[2][(hi >> 8) & 0xff] ^
+        kCrc.t[1][(hi >> 16) & 0xff] ^ kCrc.t[0][hi >> 24];
   }
+  for (; len > 0; --len) c = kCrc.t[0][(c ^ *buf++) & 0xff] ^ (c >> 8);
   return c;
 }
-// }}} End code taken from www.w3.org/TR/PNG/#D-CRCAppendix
-
-void xwrite(const void* ptr, size_t len, FILE* fp, uint32_t* crc) {
-  size_t ret = fwrite(ptr, 1, len, fp);
-  if (ret != len) {
-    err(1, "fwrite() returned %zd, expected %zd", ret, len);
-  }
-  if (crc) {
-    *crc = update_crc(*crc, (const uint8_t*)ptr, len);
-  }
-}
 
+// A chunk, laid out as it goes in the file: length (4 bytes, network order),
+// chunk type/name (4 bytes), chunk data and CRC (network-byte-order CRC-32
+// computed over the chunk type and chunk data, but not the length).
 class PNGChunk {
  public:
-  PNGChunk(const char* chunk_type) : chunk_type_(chunk_type) {}
+  // reserve is how many bytes of data to make room for.
+  PNGChunk(const char* chunk_type, size_t reserve = 0) {
+    buf_.reserve(12 + reserve);
+    buf_.resize(8);
+    memcpy(&buf_[4], chunk_type, 4);
+  }
 
-  void add(std::string s) { data_ << s; }
+  void add(const std::string& s) { buf_.append(s); }
 
   void add32_be(uint32_t i) {
     // Big endian. (used by png and zlib format)
     uint32_t u = htonl(i);
-    data_ << std::string((const char*)(&u), 4);
+    buf_.append((const char*)(&u), 4);
   }
 
-  void add16_le(uint16_t i) {
-    // Little endian. (used by deflate format)
-    data_ << std::string((const char*)(&i), 2);
-  }
+  void add8(uint8_t i) { buf_.push_back(i); }
 
-  void add8(uint8_t i) { data_ << std::string((const char*)(&i), 1); }
+  // For appending data in place, e.g. with Deflate().
+  std::string* data() { return &buf_; }
 
-  void write_to_file(FILE* fp) {
-    std::string s = data_.str();
-    {
-      uint32_t len = htonl(s.length());
-      xwrite(&len, sizeof(len), fp, NULL);
-    }
-    uint32_t crc = ~0;
-    xwrite(chunk_type_, 4, fp, &crc);
-    xwrite(s.data(), s.length(), fp, &crc);
-    crc = htonl(crc ^ (~0));
-    xwrite(&crc, sizeof(crc), fp, NULL);
+  // Fills in the length and appends the CRC. After this, bytes() is the
+  // whole chunk.
+  void finish() {
+    const uint32_t len = htonl(buf_.length() - 8);
+    memcpy(&buf_[0], &len, 4);
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(buf_.data());
+    add32_be(update_crc(~0u, p + 4, buf_.length() - 4) ^ ~0u);
   }
 
+  const std::string& bytes() const { return buf_; }
+
  private:
-  const char* chunk_type_;
-  std::stringstream data_;
+  std::string buf_;
 };
 
 constexpr uint32_t initial_adler = 1;
 
-uint32_t update_adler32(uint32_t adler, const uint8_t* buf, int len) {
-  uint16_t s1 = adler & 0xffff;
-  uint16_t s2 = (adler >> 16) & 0xffff;
-
-  for (int i = 0; i < len; ++i) {
-    s1 = (s1 + buf[i]) % 65521;
-    s2 = (s2 + s1) % 65521;
+// Sums are only reduced modulo 65521 every kAdlerRun bytes, the most that
+// can't overflow 32 bits (zlib's NMAX, rounded down to whole 32-byte
+// blocks). Within a run, each 32-byte block adds up its bytes and its
+// position-weighted bytes independently, which compiles to SIMD.
+uint32_t update_adler32(uint32_t adler, const uint8_t* buf, size_t len) {
+  constexpr uint32_t kBase = 65521;
+  constexpr int kBlock = 32;
+  constexpr size_t kAdlerRun = 5536;
+  uint32_t s1 = adler & 0xffff;
+  uint32_t s2 = (adler >> 16) & 0xffff;
+  while (len > 0) {
+    size_t n = std::min(len, kAdlerRun);
+    len -= n;
+    for (; n >= kBlock; n -= kBlock, buf += kBlock) {
+      uint32_t sum = 0;
+      uint32_t weighted = 0;
+      for (int i = 0; i < kBlock; ++i) {
+        sum += buf[i];
+        weighted += (kBlock - i) * buf[i];
+      }
+      s2 += kBlock * s1 + weighted;
+      s1 += sum;
+    }
+    for (; n > 0; --n) {
+      s1 += *buf++;
+      s2 += s1;
+    }
+    s1 %= kBase;
+    s2 %= kBase;
   }
   return (s2 << 16) | s1;
 }
 
-// This isn't deflate, it just wraps uncompressed data in the deflate block
-// format.
-class Deflate {
- public:
-  Deflate() : adler_(initial_adler) {}
+// Returns the Adler-32 of two pieces of data back to back, from the Adler-32
+// of each and the length of the second. From zlib's adler32_combine().
+uint32_t adler32_combine(uint32_t adler1, uint32_t adler2, size_t len2) {
+  constexpr uint32_t kBase = 65521;
+  const uint32_t rem = len2 % kBase;
+  uint32_t sum1 = adler1 & 0xffff;
+  uint32_t sum2 = (uint64_t(rem) * sum1) % kBase;
+  sum1 += (adler2 & 0xffff) + kBase - 1;
+  sum2 += ((adler1 >> 16) & 0xffff) + ((adler2 >> 16) & 0xffff) + kBase - rem;
+  if (sum1 >= kBase) sum1 -= kBase;
+  if (sum1 >= kBase) sum1 -= kBase;
+  if (sum2 >= kBase << 1) sum2 -= kBase << 1;
+  if (sum2 >= kBase) sum2 -= kBase;
+  return sum1 | (sum2 << 16);
+}
 
-  void add8(uint8_t i) {
-    data_ << std::string((const char*)(&i), 1);
-    adler_ = update_adler32(adler_, &i, 1);
+// Starts a zlib stream (RFC 1950), the wrapper PNG wants around deflate data.
+void write_zlib_header(int level, PNGChunk* chunk) {
+  // CMF
+  unsigned int cm = 8;     // Deflate, mandated by PNG.
+  unsigned int cinfo = 7;  // 32K window size, max allowed by PNG.
+  uint8_t cmf = cm | (cinfo << 4);
+
+  // FLG
+  unsigned int fcheck;
+  unsigned int fdict = 0;  // No dict present.
+  // Which algorithm, from fastest to slowest, using zlib's levels.
+  unsigned int flevel =
+      (level < 2) ? 0 : (level < 6) ? 1 : (level == 6) ? 2 : 3;
+  uint8_t flg = (fdict << 5) | (flevel << 6);
+  // choose fcheck so that (CMF*256 + FLG) is a multiple of 31.
+  fcheck = 31 - ((cmf * 256 + flg) % 31);
+  flg |= (fcheck & 31);
+  assert((cmf * 256 + flg) % 31 == 0);
+  chunk->add8(cmf);
+  chunk->add8(flg);
+}
+
+int paeth(int a, int b, int c) {
+  int p = a + b - c;
+  int pa = abs(p - a);
+  int pb = abs(p - b);
+  int pc = abs(p - c);
+  if (pa <= pb && pa <= pc) return a;
+  if (pb <= pc) return b;
+  return c;
+}
+
+// Appends a scanline to out: its filter type, then the filtered bytes. prev
+// is the scanline above, all zeros for the first one. Tries all five filters
+// and keeps the one whose output has the smallest sum of absolute values, as
+// signed bytes. That's the heuristic the PNG spec recommends, it tends to
+// pick the output that compresses best. If prev is null, only tries the
+// filters that don't use it, None and Sub. scratch must have room for five
+// rows.
+void filter_row(const uint8_t* row, const uint8_t* prev, int len, int bpp,
+                uint8_t* scratch, std::string* out) {
+  constexpr int kNumFilters = 5;  // None, Sub, Up, Average, Paeth.
+  uint8_t* filtered[kNumFilters];
+  for (int f = 0; f < kNumFilters; ++f) filtered[f] = scratch + f * len;
+  // One loop per filter, so that each vectorizes. The first pixel has no
+  // left neighbour.
+  for (int i = 0; i < len; ++i) {
+    const int a = (i >= bpp) ? row[i - bpp] : 0;
+    filtered[0][i] = row[i];
+    filtered[1][i] = row[i] - a;
+  }
+  const int num_filters = (prev != nullptr) ? kNumFilters : 2;
+  if (prev == nullptr) prev = row;  // Unused.
+  for (int i = 0; i < len; ++i) filtered[2][i] = row[i] - prev[i];
+  for (int i = 0; i < len; ++i) {
+    const int a = (i >= bpp) ? row[i - bpp] : 0;
+    filtered[3][i] = row[i] - (a + prev[i]) / 2;
+  }
+  for (int i = 0; i < len; ++i) {
+    const int a = (i >= bpp) ? row[i - bpp] : 0;   // Left.
+    const int b = prev[i];                         // Up.
+    const int c = (i >= bpp) ? prev[i - bpp] : 0;  // Up and left.
+    filtered[4][i] = row[i] - paeth(a, b, c);
   }
 
-  void write_to_chunk(PNGChunk* chunk) {
-    // CMF
-    unsigned int cm = 8;     // Deflate, mandated by PNG.
-    unsigned int cinfo = 7;  // 32K window size, max allowed by PNG.
-    uint8_t cmf = cm | (cinfo << 4);
-
-    // FLG
-    unsigned int fcheck;
-    unsigned int fdict = 0;   // No dict present.
-    unsigned int flevel = 0;  // Fastest algorithm.
-    uint8_t flg = (fdict << 5) | (flevel << 6);
-    // choose fcheck so that (CMF*256 + FLG) is a multiple of 31.
-    fcheck = 31 - ((cmf * 256 + flg) % 31);
-    flg |= (fcheck & 31);
-    assert((cmf * 256 + flg) % 31 == 0);
-    chunk->add8(cmf);
-    chunk->add8(flg);
-
-    // Produce deflate blocks of uncompressed data.
-    const size_t max_len = 65535;  // Specified as maximum.
-    std::string s = data_.str();
-    size_t pos = 0;
-    while (pos < s.length()) {
-      int bfinal = 0;
-      int btype = 0;  // No compression.
-      if (pos + max_len >= s.length()) {
-        bfinal = 1;
-      }
-      uint8_t header = bfinal | (btype << 2);  // Little endian.
-      chunk->add8(header);
+  int best = 0;
+  int best_sum = 0;
+  for (int f = 0; f < num_filters; ++f) {
+    int sum = 0;
+    for (int i = 0; i < len; ++i) sum += abs(int8_t(filtered[f][i]));
+    if (f == 0 || sum < best_sum) {
+      best = f;
+      best_sum = sum;
+    }
+  }
+  out->push_back(best);
+  out->append(reinterpret_cast<const char*>(filtered[best]), len);
+}
 
-      size_t len = s.length() - pos;
-      if (len > max_len) {
-        len = max_len;
-      }
-      assert(len <= kUInt16Max);
-      uint16_t len1 = uint16_t(len);
-      uint16_t nlen = ~len1;
-      chunk->add16_le(len1);
-      chunk->add16_le(nlen);
-      chunk->add(std::string(s.data() + pos, len));
-      pos += len;
+// Writes all of iov to fd, in as few writev() calls as it takes.
+void xwritev(int fd, std::vector<iovec> iov) {
+  size_t i = 0;
+  while (i < iov.size()) {
+    const int n = std::min<size_t>(iov.size() - i, IOV_MAX);
+    const ssize_t ret = writev(fd, &iov[i], n);
+    if (ret < 0) {
+      err(1, "writev() failed");
+    }
+    // Skip what got written, which might end partway through an iovec.
+    size_t done = ret;
+    while (i < iov.size() && done >= iov[i].iov_len) {
+      done -= iov[i].iov_len;
+      ++i;
+    }
+    if (done > 0) {
+      iov[i].iov_base = static_cast<char*>(iov[i].iov_base) + done;
+      iov[i].iov_len -= done;
     }
-    chunk->add32_be(adler_);
   }
+}
 
- private:
-  uint32_t adler_;
-  std::stringstream data_;
+iovec chunk_iovec(const PNGChunk& chunk) {
+  return iovec{const_cast<char*>(chunk.bytes().data()),
+               chunk.bytes().length()};
+}
+
+}  // namespace
+
+// Rows [y0, y1) of the image, filtered and compressed on their own so that
+// bands can be encoded in parallel, and as soon as their rows are done. Every
+// band but the last ends with a sync flush, so the bands' deflate streams join
+// up into one.
+struct PngWriter::Band {
+  int y0, y1;
+  std::atomic<int64_t> remaining{0};  // Pixels not reported by Done() yet.
+  std::atomic<bool> claimed{false};   // A thread has started encoding it.
+  std::atomic<bool> ready{false};     // Encoded, waiting to be written.
+  // Each band is an IDAT chunk. Decoders join the IDATs up into one zlib
+  // stream: the header goes in the first and the checksum of the whole thing
+  // in the last.
+  std::unique_ptr<PNGChunk> idat;
+  uint32_t adler;  // Of the filtered rows.
+  size_t raw_len;  // Length of the filtered rows.
 };
 
-void write_png(const char* filename, uint32_t width, uint32_t height,
-               const uint8_t* image, uint32_t gamma_times_100000) {
-  FILE* fp = fopen(filename, "wb");
-  if (fp == NULL) {
-    err(1, "fopen(\"%s\") failed", filename);
+PngWriter::PngWriter(const char* filename, const Image& img, int level,
+                     ToneMap tone)
+    : img_(img), level_(level), encoder_(tone), adler_(initial_adler) {
+  // Bands are about this many bytes of pixels. Where they start doesn't
+  // depend on the number of threads, so neither does the output.
+  constexpr int kBandBytes = 1 << 20;
+  band_rows_ = std::max(1, kBandBytes / (img.width_ * 3));
+  num_bands_ = (img.height_ + band_rows_ - 1) / band_rows_;
+  bands_.reset(new Band[num_bands_]);
+  for (int i = 0; i < num_bands_; ++i) {
+    Band& b = bands_[i];
+    b.y0 = i * band_rows_;
+    b.y1 = std::min(img.height_, b.y0 + band_rows_);
+    b.remaining = int64_t(b.y1 - b.y0) * img.width_;
+  }
+
+  fd_ = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd_ < 0) {
+    err(1, "open(\"%s\") failed", filename);
   }
 
   const uint8_t magic[] = {
@@ -206,80 +321,154 @@ void write_png(const char* filename, uint32_t width, uint32_t height,
       0x0a,  // Unix-style line ending (LF) to detect Unix-DOS line ending
              // conversion.
   };
-  xwrite(magic, sizeof(magic), fp, NULL);
-
-  // A chunk consists of four parts: length (4 bytes, network order), chunk
-  // type/name (4 bytes), chunk data and CRC (network-byte-order CRC-32 computed
-  // over the chunk type and chunk data, but not the length.
 
   // Chunks we want: IHDR, gAMA, IDAT, IEND
 
   // IHDR
+  PNGChunk ihdr("IHDR", 13);
   {
     int bit_depth = 8;
     int color_type = 2;          // Truecolor
     int compression_method = 0;  // The only standard one.
     int filter_method = 0;       // The only standard one.
     int interlace_method = 0;    // No interlace.
-    PNGChunk ihdr("IHDR");
-    ihdr.add32_be(width);
-    ihdr.add32_be(height);
+    ihdr.add32_be(img.width_);
+    ihdr.add32_be(img.height_);
     ihdr.add8(bit_depth);
     ihdr.add8(color_type);
     ihdr.add8(compression_method);
     ihdr.add8(filter_method);
     ihdr.add8(interlace_method);
-    ihdr.write_to_file(fp);
+    ihdr.finish();
   }
 
-  {
-    PNGChunk gama("gAMA");
-    gama.add32_be(gamma_times_100000);
-    gama.write_to_file(fp);
+  PNGChunk gama("gAMA", 4);
+  gama.add32_be(45455);  // Gamma times 100000.
+  gama.finish();
+
+  xwritev(fd_, {iovec{const_cast<uint8_t*>(magic), sizeof(magic)},
+                chunk_iovec(ihdr), chunk_iovec(gama)});
+}
+
+PngWriter::~PngWriter() {
+  if (fd_ >= 0) Finish();
+}
+
+void PngWriter::Done(int x0, int y0, int x1, int y1) {
+  for (int y = y0; y < y1;) {
+    const int band = y / band_rows_;
+    const int rows = std::min(y1, bands_[band].y1) - y;
+    const int64_t pixels = int64_t(rows) * (x1 - x0);
+    // The thread that reports a band's last pixels encodes it. acq_rel makes
+    // the other threads' pixels visible to it.
+    if (bands_[band].remaining.fetch_sub(pixels, std::memory_order_acq_rel) ==
+            pixels &&
+        !bands_[band].claimed.exchange(true)) {
+      Encode(band);
+      WriteReady();
+    }
+    y += rows;
   }
+}
 
-  {
-    PNGChunk idat("IDAT");
-    Deflate deflate;
-    // Input is 32 bits but we need 24 bits.
-    size_t pos = 0;
-    for (int y = 0; y < height; ++y) {
-      // Emit filter type at start of scanline.
-      deflate.add8(0);
-      for (int x = 0; x < width; ++x) {
-        for (int c = 0; c < 3; ++c) {
-          deflate.add8(image[pos++]);
-        }
+void PngWriter::Finish(ThreadPool* pool) {
+  // Encode whatever Done() didn't, e.g. because rendering was interrupted.
+  std::atomic<int> next_band{0};
+  auto encode = [&](int) {
+    for (int i; (i = next_band.fetch_add(1)) < num_bands_;) {
+      if (!bands_[i].claimed.exchange(true)) {
+        Encode(i);
+        WriteReady();
       }
     }
-    deflate.write_to_chunk(&idat);
-    idat.write_to_file(fp);
+  };
+  if (pool != nullptr) {
+    pool->Run(encode);
+  } else {
+    encode(0);
   }
+  assert(next_write_ == num_bands_);
 
-  {
-    PNGChunk iend("IEND");
-    iend.write_to_file(fp);
+  PNGChunk iend("IEND");
+  iend.finish();
+  xwritev(fd_, {chunk_iovec(iend)});
+  if (close(fd_) != 0) {
+    err(1, "close() failed");
   }
-
-  fclose(fp);
+  fd_ = -1;
 }
 
-}  // namespace
+// Fills in the band's IDAT, except for the last band's Adler-32 and CRC,
+// which need the other bands.
+void PngWriter::Encode(int i) {
+  Band* band = &bands_[i];
+  const bool first = (i == 0);
+  const bool last = (i == num_bands_ - 1);
+  const int row_len = img_.width_ * 3;
+  // Two rows: the one we're filtering and the one above it, then room for
+  // filter_row() to try out filters.
+  std::unique_ptr<uint8_t[]> rows(new uint8_t[row_len * 7]());
+  uint8_t* prev = rows.get();
+  uint8_t* row = prev + row_len;
+  uint8_t* scratch = row + row_len;
+  std::vector<double> pixels(row_len);  // In case the image isn't doubles.
+
+  // Filter type byte, then the pixels, for every scanline. Filters don't
+  // help if we're not compressing. The row above the band might not be
+  // rendered yet, so its first row can't use filters that look at it (the
+  // row above the image counts as zeros).
+  std::string raw;
+  raw.reserve((row_len + 1) * (band->y1 - band->y0));
+  for (int y = band->y0; y < band->y1; ++y) {
+    encoder_.Row(img_.Row(y, 0, img_.width_, pixels.data()), row_len, row);
+    if (level_ == 0) {
+      raw.push_back(0);
+      raw.append(reinterpret_cast<const char*>(row), row_len);
+    } else {
+      const bool have_prev = (y == 0 || y > band->y0);
+      filter_row(row, have_prev ? prev : nullptr, row_len, 3, scratch, &raw);
+    }
+    std::swap(prev, row);
+  }
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(raw.data());
+  band->adler = update_adler32(initial_adler, bytes, raw.length());
+  band->raw_len = raw.length();
+
+  // Stored data is a little bigger than the input, leave room for that.
+  const size_t reserve = (level_ == 0)
+                             ? raw.length() + raw.length() / 1024 + 16
+                             : raw.length() / 2;
+  band->idat.reset(new PNGChunk("IDAT", reserve));
+  if (first) write_zlib_header(level_, band->idat.get());
+  Deflate(bytes, raw.length(), level_, last, band->idat->data());
+  if (!last) band->idat->finish();
+  band->ready.store(true, std::memory_order_release);
+}
 
-void Writepng(const Image& img, const char* filename) {
-  const int w = img.width_;
-  const int h = img.height_;
-  std::unique_ptr<uint8_t[]> data(new uint8_t[w * h * 3]);
-
-  const double* src = img.data_.get();
-  uint8_t* dst = data.get();
-  for (int y = 0; y < h; ++y)
-    for (int x = 0; x < w; ++x) {
-      dst[0] = Image::from_float(src[0]);
-      dst[1] = Image::from_float(src[1]);
-      dst[2] = Image::from_float(src[2]);
-      dst += 3;
-      src += 3;
+// Writes out the bands that are ready and have all the bands above them
+// written, and frees them.
+void PngWriter::WriteReady() {
+  std::lock_guard<std::mutex> lock(write_mu_);
+  const int start = next_write_;
+  std::vector<iovec> iov;
+  while (next_write_ < num_bands_ &&
+         bands_[next_write_].ready.load(std::memory_order_acquire)) {
+    Band& b = bands_[next_write_];
+    adler_ = adler32_combine(adler_, b.adler, b.raw_len);
+    if (next_write_ == num_bands_ - 1) {
+      b.idat->add32_be(adler_);
+      b.idat->finish();
     }
-  write_png(filename, w, h, data.get(), 45455);
+    iov.push_back(chunk_iovec(*b.idat));
+    ++next_write_;
+  }
+  if (iov.empty()) return;
+  xwritev(fd_, std::move(iov));
+  for (int i = start; i < next_write_; ++i) bands_[i].idat.reset();
+}
+
+void Writepng(const Image& img, const char* filename, int level,
+              ThreadPool* pool, ToneMap tone) {
+  PngWriter png(filename, img, level, tone);
+  png.Finish(pool);
 }
@@ -1,2 +1,52 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+#include "deflate.h"
+#include "imagewriter.h"
+#include "tonemap.h"
+
 class Image;
-void Writepng(const Image& img, const char* filename);
+class ThreadPool;
+
+// level is the deflate compression level, from 0 (none) to kDeflateMaxLevel.
+// With a pool, bands of rows are filtered and compressed in parallel.
+void Writepng(const Image& img, const char* filename,
+              int level = kDeflateDefaultLevel, ThreadPool* pool = nullptr,
+              ToneMap tone = ToneMap::kClamp);
+
+// Writes img to a PNG file while it's being rendered. The image is split into
+// bands of rows. When Done() has been told about every pixel of a band, the
+// thread that finished it compresses the band, and the bands that are ready
+// in order go out to the file. Finish() compresses the bands Done() didn't
+// finish.
+class PngWriter : public ImageWriter {
+ public:
+  // Opens the file and writes the header. img must outlive the writer.
+  PngWriter(const char* filename, const Image& img,
+            int level = kDeflateDefaultLevel, ToneMap tone = ToneMap::kClamp);
+  ~PngWriter() override;
+
+  void Done(int x0, int y0, int x1, int y1) override;
+  void Finish(ThreadPool* pool = nullptr) override;
+
+ private:
+  struct Band;
+
+  void Encode(int band);
+  void WriteReady();
+
+  const Image& img_;
+  const int level_;
+  const Encoder encoder_;
+  int fd_;
+  int band_rows_;
+  int num_bands_;
+  std::unique_ptr<Band[]> bands_;
+  std::mutex write_mu_;  // Guards the members below.
+  int next_write_ = 0;   // First band not written yet.
+  uint32_t adler_;       // Of the bands written so far.
+};
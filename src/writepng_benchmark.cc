@@ -0,0 +1,37 @@
+// Benchmarks of writing PNG files.
+#include <benchmark/benchmark.h>
+
+#include "image.h"
+#include "random.h"
+#include "writepng.h"
+
+namespace {
+
+// A smooth gradient with some noise on top, like a render with few samples.
+Image TestImage(int width, int height) {
+  Image img(width, height);
+  Random rng;
+  double* p = img.data();
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      const double g = double(x + y) / (width + height);
+      for (int c = 0; c < 3; ++c) {
+        *p++ = g * (.8 + .4 * rng.rand()) * (c + 1) / 3;
+      }
+    }
+  }
+  return img;
+}
+
+// Arg is the compression level.
+void BM_Writepng(benchmark::State& state) {
+  const Image img = TestImage(1024, 768);
+  const int level = state.range(0);
+  for (auto _ : state) Writepng(img, "/dev/null", level);
+  state.SetBytesProcessed(state.iterations() * img.width_ * img.height_ * 3);
+}
+BENCHMARK(BM_Writepng)->Arg(0)->Arg(1)->Arg(6)->Unit(benchmark::kMillisecond);
+
+}  // namespace
+
+BENCHMARK_MAIN();